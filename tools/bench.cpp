@@ -0,0 +1,269 @@
+//
+// Benchmark and regression support for the converters' bench modes.  Each
+// stage is timed and reported with its throughput, and outputs are hashed
+// and compared with a golden list, so speed work on the tools can't quietly
+// change bytes the engine reads.  None of this is thread safe: run stages
+// and record hashes from the main thread
+//
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct BenchStage
+{
+	std::string name;
+	double seconds;
+	double bytes;
+};
+
+struct BenchHash
+{
+	std::string name;
+	uint64_t hash;
+};
+
+std::vector<BenchStage> benchStages;
+std::vector<BenchHash> benchHashes;
+
+//
+// Runs stage(), which returns how many bytes it worked through (0 if that
+// means nothing for the stage), and records how long it took
+//
+template<typename Stage>
+void BenchRun(const char* name, Stage stage)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double bytes = stage();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	BenchStage result;
+	result.name = name;
+	result.seconds = elapsed.count();
+	result.bytes = bytes;
+	benchStages.push_back(result);
+}
+
+size_t BenchPeakMemory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return counters.PeakWorkingSetSize;
+	}
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		// Kilobytes on Linux
+		return (size_t) usage.ru_maxrss * 1024;
+	}
+#endif
+	return 0;
+}
+
+void BenchReport()
+{
+	double totalSeconds = 0;
+
+	printf("\n%-32s %10s %10s\n", "Stage", "ms", "MB/s");
+
+	for(size_t n = 0; n < benchStages.size(); n++)
+	{
+		const BenchStage* stage = &benchStages[n];
+
+		printf("%-32s %10.1f", stage->name.c_str(), stage->seconds * 1000);
+		if(stage->bytes > 0 && stage->seconds > 0)
+		{
+			printf(" %10.1f", stage->bytes / stage->seconds / (1024 * 1024));
+		}
+		printf("\n");
+		totalSeconds += stage->seconds;
+	}
+
+	printf("%-32s %10.1f\n", "Total", totalSeconds * 1000);
+	printf("Peak memory: %.1f MB\n", BenchPeakMemory() / (1024.0 * 1024.0));
+}
+
+//
+// 64 bit FNV-1a.  Start from HASH_START, or pass in an earlier result to
+// hash several buffers as one
+//
+#define HASH_START 0xcbf29ce484222325ULL
+
+uint64_t HashBytes(uint64_t hash, const void* data, size_t length)
+{
+	const uint8_t* bytes = (const uint8_t*) data;
+
+	for(size_t i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+void BenchAddHash(const char* name, const void* data, size_t length)
+{
+	BenchHash entry;
+	entry.name = name;
+	entry.hash = HashBytes(HASH_START, data, length);
+	benchHashes.push_back(entry);
+}
+
+//
+// Hashes an output file, recorded as its filename followed by options, so
+// runs with options that change the output keep their own golden entries.
+// Returns false, recording nothing, if it doesn't exist, so outputs that
+// depend on options can all be passed in
+//
+bool BenchAddFileHash(const char* filename, const char* options = "")
+{
+	FILE* fs = fopen(filename, "rb");
+	if(!fs)
+	{
+		return false;
+	}
+
+	fseek(fs, 0, SEEK_END);
+	long size = ftell(fs);
+	fseek(fs, 0, SEEK_SET);
+
+	std::vector<uint8_t> data(size > 0 ? size : 1);
+	size_t length = fread(data.data(), 1, size, fs);
+	fclose(fs);
+
+	BenchAddHash((std::string(filename) + options).c_str(), data.data(), length);
+	return true;
+}
+
+bool BenchReadGolden(const char* filename, std::vector<BenchHash>* golden)
+{
+	FILE* fs = fopen(filename, "r");
+	if(!fs)
+	{
+		return false;
+	}
+
+	char line[512];
+
+	while(fgets(line, sizeof(line), fs))
+	{
+		unsigned long long hash;
+		char name[480];
+
+		if(sscanf(line, "%llx %479[^\r\n]", &hash, name) == 2)
+		{
+			BenchHash entry;
+			entry.name = name;
+			entry.hash = hash;
+			golden->push_back(entry);
+		}
+	}
+	fclose(fs);
+	return true;
+}
+
+BenchHash* BenchFindHash(std::vector<BenchHash>& hashes, const std::string& name)
+{
+	for(size_t n = 0; n < hashes.size(); n++)
+	{
+		if(hashes[n].name == name)
+		{
+			return &hashes[n];
+		}
+	}
+	return NULL;
+}
+
+//
+// Compares the recorded hashes with the golden file, one "<hash> <name>"
+// per line.  If update is set the recorded hashes are written into it
+// instead, replacing any entries with the same names and keeping the rest.
+// A missing golden file is a failure unless update is set.  Golden entries
+// that weren't recorded this run are ignored.  Returns the number of outputs
+// that don't match
+//
+int BenchCheckGolden(const char* filename, bool update)
+{
+	std::vector<BenchHash> golden;
+	bool haveGolden = BenchReadGolden(filename, &golden);
+
+	if(!haveGolden && !update)
+	{
+		printf("No golden file %s, run with golden to write one\n", filename);
+		return (int) benchHashes.size();
+	}
+
+	if(update)
+	{
+		for(size_t n = 0; n < benchHashes.size(); n++)
+		{
+			BenchHash* existing = BenchFindHash(golden, benchHashes[n].name);
+
+			if(existing)
+			{
+				existing->hash = benchHashes[n].hash;
+			}
+			else
+			{
+				golden.push_back(benchHashes[n]);
+			}
+		}
+
+		FILE* fs = fopen(filename, "w");
+		if(!fs)
+		{
+			printf("Could not open %s for writing\n", filename);
+			return 1;
+		}
+		for(size_t n = 0; n < golden.size(); n++)
+		{
+			fprintf(fs, "%016llx %s\n", (unsigned long long) golden[n].hash, golden[n].name.c_str());
+		}
+		fclose(fs);
+
+		printf("Wrote %d golden hashes to %s\n", (int) benchHashes.size(), filename);
+		return 0;
+	}
+
+	int mismatches = 0;
+
+	for(size_t n = 0; n < benchHashes.size(); n++)
+	{
+		const BenchHash* entry = &benchHashes[n];
+		const BenchHash* expected = BenchFindHash(golden, entry->name);
+
+		if(!expected)
+		{
+			printf("%s: not in %s\n", entry->name.c_str(), filename);
+			mismatches++;
+		}
+		else if(expected->hash != entry->hash)
+		{
+			printf("%s: hash %016llx, expected %016llx\n", entry->name.c_str(), (unsigned long long) entry->hash, (unsigned long long) expected->hash);
+			mismatches++;
+		}
+	}
+
+	if(mismatches)
+	{
+		printf("%d of %d outputs differ from %s\n", mismatches, (int) benchHashes.size(), filename);
+	}
+	else
+	{
+		printf("All %d outputs match %s\n", (int) benchHashes.size(), filename);
+	}
+	return mismatches;
+}
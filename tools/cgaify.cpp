@@ -1,7 +1,12 @@
 #include "lodepng.cpp"
 #include <stdint.h>
 #include <stdio.h>
+#include <algorithm>
+#include <map>
 #include "huffman.cpp"
+#include "mappedfile.cpp"
+#include "jobs.cpp"
+#include "bench.cpp"
 
 using namespace std;
 
@@ -15,6 +20,7 @@ enum CgaMode
 	CGA_COMPOSITE,
 	TANDY160,
 	INVERT_MONO,
+	EGA_PLANAR,
 	NUM_GFX_MODES
 };
 
@@ -23,7 +29,8 @@ const char* headFilename[] =
 	"CGAHEAD.WL6",
 	"COMHEAD.WL6",
 	"TGAHEAD.WL6",
-	"LCDHEAD.WL6"
+	"LCDHEAD.WL6",
+	"EGAHEAD.WL6"
 };
 
 const char* gfxFilename[] =
@@ -31,7 +38,17 @@ const char* gfxFilename[] =
 	"CGAGRAPH.WL6",
 	"COMGRAPH.WL6",
 	"TGAGRAPH.WL6",
-	"LCDGRAPH.WL6"
+	"LCDGRAPH.WL6",
+	"EGAGRAPH.WL6"
+};
+
+const char* dictFilename[] =
+{
+	"CGADICT.WL6",
+	"COMDICT.WL6",
+	"TGADICT.WL6",
+	"LCDDICT.WL6",
+	"EGADICT.WL6"
 };
 
 const char* headFilenameDemo[] =
@@ -39,7 +56,17 @@ const char* headFilenameDemo[] =
 	"CGAHEAD.WL1",
 	"COMHEAD.WL1",
 	"TGAHEAD.WL1",
-	"LCDHEAD.WL1"
+	"LCDHEAD.WL1",
+	"EGAHEAD.WL1"
+};
+
+const char* dictFilenameDemo[] =
+{
+	"CGADICT.WL1",
+	"COMDICT.WL1",
+	"TGADICT.WL1",
+	"LCDDICT.WL1",
+	"EGADICT.WL1"
 };
 
 const char* gfxFilenameDemo[] =
@@ -47,7 +74,8 @@ const char* gfxFilenameDemo[] =
 	"CGAGRAPH.WL1",
 	"COMGRAPH.WL1",
 	"TGAGRAPH.WL1",
-	"LCDGRAPH.WL1"
+	"LCDGRAPH.WL1",
+	"EGAGRAPH.WL1"
 };
 
 #define NUM_PATTERNS (sizeof(patterns) / 4)
@@ -236,6 +264,7 @@ uint8_t convertLUT[256];
 uint8_t convertLUTComposite[256];
 uint8_t convertLUTTandy[256];
 uint8_t convertLUTLCD[256];
+uint8_t convertLUTEGA[256];
 
 uint8_t wolfPalette[256 * 3];
 
@@ -256,6 +285,12 @@ int picsToDitherDemo[] =
 { 3, 4, 11, 13, 21, 22, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 55, 96, 97, 99, 102, 145, 146};
 
 bool dumpPalettes = false;
+bool verifyRecompress = false;
+bool optimiseDictionaries = false;
+bool optimiseLayout = false;
+bool expandMaps = false;
+bool runBenchmark = false;
+bool updateGolden = false;
 
 bool ShouldDither(int chunkNumber)
 {
@@ -548,414 +583,1724 @@ void GenerateLUT()
 			convertLUTTandy[index] = pattern;
 			
 			convertLUTLCD[index] = lcdPatterns[MatchLCDPattern(rgb)];
+			
+			// cgaPalette is the standard 16 colour palette, which is also
+			// what the EGA comes up with
+			convertLUTEGA[index] = (uint8_t) FindClosestPaletteEntry(rgb, cgaPalette, 16);
 		}
 	}
 }
 
-void GenerateDataFile(const char* filename, uint8_t* data, int dataLength, uint8_t* conversionTable)
+struct VSwapHeader
+{
+	uint16_t numChunks;
+	uint16_t spriteStart;
+	uint16_t soundStart;
+	const uint32_t* chunkOffsets;
+	const uint16_t* chunkLengths;
+};
+
+void ReadVSwapHeader(const uint8_t* data, VSwapHeader* header)
 {
-	printf("Generating %s..\n", filename);
-	uint8_t* newData = new uint8_t[dataLength];
-	memcpy(newData, data, dataLength);
-	data = newData;
+	const uint16_t* ptr = (const uint16_t*) data;
+	header->numChunks = *ptr++;
+	header->spriteStart = *ptr++;
+	header->soundStart = *ptr++;
 	
-	uint16_t* ptr = (uint16_t*) data;
-	uint16_t numChunks = *ptr++;
-	uint16_t spriteStart = *ptr++;
-	uint16_t soundStart = *ptr++;
+	header->chunkOffsets = (const uint32_t*)(ptr);
+	ptr += header->numChunks * 2;
+	header->chunkLengths = ptr;
+}
 
-	uint32_t* chunkOffsets = (uint32_t*)(ptr);
-	ptr += numChunks * 2;
-	uint16_t* chunkLengths = ptr;
-	ptr += numChunks;
+//
+// Chunk numbers sorted by where they are in the file, skipping sparse chunks
+//
+void GetChunkFileOrder(VSwapHeader* header, vector<int>* chunkOrder)
+{
+	chunkOrder->clear();
 	
-	for(int n = 0; n < numChunks; n++)
+	for(int n = 0; n < header->numChunks; n++)
 	{
-		uint8_t* chunkPtr = data + chunkOffsets[n];
-		uint32_t chunkLength = chunkLengths[n];
-		if(n < spriteStart)
+		if(header->chunkOffsets[n])
 		{
-			// This is a texture
-			for(int x = 0; x < chunkLength; x++)
-			{
-				chunkPtr[x] = conversionTable[chunkPtr[x]];
-			}
+			chunkOrder->push_back(n);
 		}
-		else if(n < soundStart)
-		{
-			// This is a sprite
-			uint16_t* spritePtr = (uint16_t*)(chunkPtr);
-			uint16_t leftpix = *spritePtr++;
-			uint16_t rightpix = *spritePtr++;
+	}
+	
+	sort(chunkOrder->begin(), chunkOrder->end(), [header](int a, int b)
+	{
+		return header->chunkOffsets[a] < header->chunkOffsets[b];
+	});
+}
 
-			if (leftpix >= 64 || rightpix >= 64 || leftpix > rightpix)
+//
+// Chunk layout optimiser.  With the "layout" option the page files are
+// written in the order the levels use their chunks instead of VSWAP order,
+// so that a level's walls and sprites sit together and loading them seeks
+// forward through one region.  Chunks that most levels use go first, then
+// each level in turn brings in the ones no earlier level needed, and
+// anything the map planes don't mention (actors, weapons, sounds) follows in
+// its original order.  The engine only finds chunks through the offset
+// table, so it reads the result the same way
+//
+#define NUMMAPS 100
+#define MAPPLANES 3
+#define MAPSIZE 64
+#define NEARTAG 0xa7
+#define FARTAG 0xa8
+#define FIRSTDOORTILE 90
+#define LASTDOORTILE 101
+#define FIRSTSTATICTILE 23
+#define LASTSTATICTILE 74
+#define SPR_STAT_0 2
+
+vector<int> chunkLayout;
+
+void CarmackExpand(const uint8_t* source, const uint8_t* sourceEnd, uint16_t* dest, int length)
+{
+	uint16_t* start = dest;
+	uint16_t* end = dest + length;
+	
+	while(dest < end && source + 2 <= sourceEnd)
+	{
+		uint16_t ch = *(const uint16_t*) source;
+		uint8_t tag = ch >> 8;
+		int count = ch & 0xff;
+		source += 2;
+		
+		if(tag != NEARTAG && tag != FARTAG)
+		{
+			*dest++ = ch;
+		}
+		else if(!count)
+		{
+			// An escaped word that happens to have a tag as its high byte
+			*dest++ = ch | *source++;
+		}
+		else
+		{
+			const uint16_t* copy;
+			
+			if(tag == NEARTAG)
 			{
-				continue;
+				copy = dest - *source++;
+			}
+			else
+			{
+				copy = start + *(const uint16_t*) source;
+				source += 2;
+			}
+			
+			if(copy < start || copy >= dest)
+			{
+				printf("Corrupt map plane\n");
+				exit(1);
 			}
-			uint16_t firstTableDataOffset = *spritePtr;
-			int numTables = rightpix - leftpix + 1;
 			
-			for(int x = 2 * numTables + 4; x < firstTableDataOffset; x++)
+			while(count-- && dest < end)
 			{
-				chunkPtr[x] = conversionTable[chunkPtr[x]];
+				*dest++ = *copy++;
 			}
 		}
 	}
-	
-	FILE* fs = fopen(filename, "wb");
-	fwrite(data, 1, dataLength, fs);
-	fclose(fs);
 }
 
-#define STARTPICS    3
-#define NUMPICSDEMO      144
-#define NUMPICSFULL      132
-#define NUMPICS (isDemo ? NUMPICSDEMO : NUMPICSFULL)
-
-struct GraphChunk
-{
-	uint8_t* data;
-	uint32_t dataSize;
-	uint32_t uncompressedSize;
-	uint8_t* uncompressedData;
-	uint32_t headerOffset;
-};
-
-void ProcessGraphics(CgaMode gfxMode)
+//
+// The reverse of CarmackExpand, for data the engine runs through
+// CAL_CarmackExpand.  Each match is the longest one found, copied from up
+// to 255 words back with a near pointer or from anywhere before with a far
+// one.  Copies can overlap the words they produce, which covers runs
+//
+void CarmackCompress(const uint16_t* source, int length, vector<uint8_t>* out)
 {
-	printf("Generating %s..\n", isDemo ? gfxFilenameDemo[gfxMode] : gfxFilename[gfxMode]);
-	
-	FILE* dictionaryFile = fopen(isDemo ? "VGADICT.WL1" : "VGADICT.WL6", "rb");
-	if(!dictionaryFile)
-	{
-		printf("Could not open dictionary\n");
-		exit(1);
-	}
-	fread(grhuffman, sizeof(grhuffman), 1, dictionaryFile);
-	fclose(dictionaryFile);
-
-	FILE* headFile = fopen(isDemo ? "VGAHEAD.WL1" : "VGAHEAD.WL6", "rb");
-	
-	if(!headFile)
-	{
-		printf("Could not open head\n");
-		exit(1);
-	}
-
-	fseek(headFile, 0, SEEK_END);
-	long headerSize = ftell(headFile);
-    fseek(headFile, 0, SEEK_SET);
-	//printf("Header file size: %d bytes\n", headerSize);
-	
-	if(headerSize % 3)
-	{
-		printf("File size not multiple of 3?\n");
-		exit(1);
-	}
-	
-	int numChunks = (headerSize / 3) - 1;
-	
-	GraphChunk* chunks = new GraphChunk[numChunks];
-	
-	//printf("Num chunks: %d\n", numChunks);
+	out->clear();
 	
-	for(int n = 0; n < numChunks + 1; n++)
+	for(int pos = 0; pos < length; )
 	{
-		uint32_t offset = 0;
+		int bestLength = 0;
+		int bestStart = 0;
 		
-		for(int i = 0; i < 3; i++)
+		for(int start = 0; start < pos; start++)
 		{
-			uint8_t offsetPart;
-			fread(&offsetPart, 1, 1, headFile);
-			offset |= (offsetPart << (i * 8));
+			int matchLength = 0;
+			while(matchLength < 255 && pos + matchLength < length && source[start + matchLength] == source[pos + matchLength])
+			{
+				matchLength++;
+			}
+			
+			// Prefer the nearest of equal matches, so it can be near
+			if(matchLength >= bestLength)
+			{
+				bestLength = matchLength;
+				bestStart = start;
+			}
 		}
 		
-		if(n < numChunks)
+		int distance = pos - bestStart;
+		
+		if(bestLength >= 2 && distance <= 255)
 		{
-			chunks[n].headerOffset = offset;
+			out->push_back((uint8_t) bestLength);
+			out->push_back(NEARTAG);
+			out->push_back((uint8_t) distance);
+			pos += bestLength;
 		}
-		if(n > 0)
+		else if(bestLength >= 3 && bestStart < 65536)
 		{
-			chunks[n - 1].dataSize = offset - chunks[n - 1].headerOffset;
+			out->push_back((uint8_t) bestLength);
+			out->push_back(FARTAG);
+			out->push_back((uint8_t) bestStart);
+			out->push_back((uint8_t)(bestStart >> 8));
+			pos += bestLength;
+		}
+		else
+		{
+			uint16_t ch = source[pos++];
+			uint8_t tag = ch >> 8;
+			
+			if(tag == NEARTAG || tag == FARTAG)
+			{
+				// Escaped as a zero length copy followed by the low byte
+				out->push_back(0);
+				out->push_back(tag);
+				out->push_back((uint8_t) ch);
+			}
+			else
+			{
+				out->push_back((uint8_t) ch);
+				out->push_back(tag);
+			}
 		}
-		
-		//printf("Chunk %d: offset: %x\n", n, offset);
 	}
+}
+
+void RLEWExpand(const uint16_t* source, const uint16_t* sourceEnd, uint16_t* dest, int length, uint16_t rlewTag)
+{
+	uint16_t* end = dest + length;
 	
-	fclose(headFile);
-	
-	FILE* graphicsFile = fopen(isDemo ? "VGAGRAPH.WL1" : "VGAGRAPH.WL6", "rb");
-	fseek(graphicsFile, 0, SEEK_END);
-	long graphicsLength = ftell(graphicsFile);
-    fseek(graphicsFile, 0, SEEK_SET);
-	
-	uint8_t* graphicsData = new uint8_t[graphicsLength];
-	fread(graphicsData, 1, graphicsLength, graphicsFile);
-	fclose(graphicsFile);
-	
-	
-	for(int n = 0; n < numChunks; n++)
+	while(dest < end && source < sourceEnd)
 	{
-		chunks[n].data = graphicsData + chunks[n].headerOffset;
-
-		if (n < STARTPICS + NUMPICS)
+		uint16_t value = *source++;
+		
+		if(value == rlewTag && source + 2 <= sourceEnd)
 		{
-			chunks[n].uncompressedSize = *(uint32_t*)(chunks[n].data);
-			chunks[n].uncompressedData = new uint8_t[chunks[n].uncompressedSize];
-
-			HuffExpand(chunks[n].data + 4, chunks[n].uncompressedData, chunks[n].uncompressedSize, grhuffman);
+			uint16_t count = *source++;
+			value = *source++;
 			
-			//TestRecompress(chunks[n].uncompressedData, chunks[n].uncompressedSize, chunks[n].compressedData, chunks[n].compressedSize - 4, grhuffman);
+			while(count-- && dest < end)
+			{
+				*dest++ = value;
+			}
 		}
 		else
 		{
-			chunks[n].uncompressedSize = NULL;
-			chunks[n].uncompressedData = NULL;
+			*dest++ = value;
 		}
 	}
+}
+
+//
+// Expands one plane in the format CA_CacheMap reads: Carmack compression
+// over RLEW compression
+//
+void ExpandMapPlane(const MappedFile* mapFile, uint32_t planeStart, uint16_t planeLength, uint16_t rlewTag, uint16_t* plane)
+{
+	memset(plane, 0, MAPSIZE * MAPSIZE * 2);
+	
+	if(planeStart + planeLength > (uint32_t) mapFile->size || planeLength < 2)
+	{
+		return;
+	}
 	
-	//printf("Graphics size: %d bytes\n", graphicsLength);
+	const uint8_t* source = mapFile->data + planeStart;
+	int carmackLength = *(const uint16_t*) source / 2;
+	vector<uint16_t> rlewData(carmackLength + 1);
 	
-	pictabletype* pictable = (pictabletype*)(chunks[0].uncompressedData);
+	CarmackExpand(source + 2, source + planeLength, rlewData.data(), carmackLength);
+	RLEWExpand(rlewData.data() + 1, rlewData.data() + carmackLength, plane, MAPSIZE * MAPSIZE, rlewTag);
+}
+
+//
+// Page file chunks each level shows from the start: the textures of its
+// wall tiles, the door pages and the sprites of its statics
+//
+void GetLevelChunkUsage(const VSwapHeader* header, const uint16_t* walls, const uint16_t* objects, vector<bool>* used)
+{
+	used->assign(header->numChunks, false);
 	
-	for(int n = STARTPICS; n < STARTPICS + NUMPICS; n++)
+	for(int n = 0; n < MAPSIZE * MAPSIZE; n++)
 	{
-		pictabletype* picmetadata = &pictable[n - STARTPICS];
-		//printf("%d : %d x %d (%d bytes)\n", n, picmetadata->width, picmetadata->height, chunks[n].uncompressedSize);
+		int tile = walls[n];
 		
-		//if(n == 0)
-		if(0)
+		if(tile > 0 && tile < 64)
 		{
-			vector<uint8_t> rgbData;
-			rgbData.resize(picmetadata->width * picmetadata->height * 4);
-			uint8_t* picData = chunks[n].uncompressedData;
-			
-			int inputIndex = 0;
-			for(int plane = 0; plane < 4; plane++)
+			for(int side = 0; side < 2; side++)
 			{
-				for(int y = 0; y < picmetadata->height; y++)
+				int chunk = (tile - 1) * 2 + side;
+				if(chunk < header->spriteStart)
 				{
-					for(int x = 0; x < picmetadata->width / 4; x++)
-					{
-						int outputIndex = 4 * (y * picmetadata->width + (x * 4) + plane);
-						uint8_t indexColour = picData[inputIndex];
-						uint8_t* rgb = &wolfPalette[indexColour * 3];
-						int patternMatch = FindClosestPaletteEntry(rgb, patternsRGB, NUM_PATTERNS, patternsRGBWeights);
-						int patternIndex = 0;
-
-						if (y & 1)
-						{
-							patternIndex = patternsShifted[patternMatch * 4 + plane];
-						}
-						else
-						{
-							patternIndex = patterns[patternMatch * 4 + plane];
-						}
-
-						//patternIndex = FindClosestPaletteEntry(rgb, palette, 4);
-						
-						rgbData[outputIndex] = palette[patternIndex * 3];
-						rgbData[outputIndex + 1] = palette[patternIndex * 3 + 1];
-						rgbData[outputIndex + 2] = palette[patternIndex * 3 + 2];
-						rgbData[outputIndex + 3] = 255;
-						
-						inputIndex++;
-						
-						
-					}
+					(*used)[chunk] = true;
 				}
 			}
-			
-			char filename[50];
-			sprintf(filename, "pic%d.png", n - STARTPICS);
-			lodepng::encode(filename, rgbData, picmetadata->width, picmetadata->height);
 		}
-
+		else if(tile >= FIRSTDOORTILE && tile <= LASTDOORTILE)
 		{
-			uint8_t* picData = chunks[n].uncompressedData;
-			uint8_t* newPicData = new uint8_t[picmetadata->width * picmetadata->height];
-			for (int y = 0; y < picmetadata->height; y++)
+			for(int chunk = header->spriteStart - 8; chunk < header->spriteStart; chunk++)
 			{
-				for (int x = 0; x < picmetadata->width / 4; x++)
-				{
-					uint8_t pixels = 0;
-
-					for (int plane = 0; plane < 4; plane++)
-					{
-						int planeIndex = (picmetadata->height * picmetadata->width / 4) * plane + y * (picmetadata->width / 4) + x;
-						uint8_t inputPixel = picData[planeIndex];
-
-						uint8_t* rgb = &wolfPalette[inputPixel * 3];
-
-						if(gfxMode == TANDY160)
-						{
-							if((plane & 1) == 0)
-							{
-								uint8_t rgbmerge[3];
-								int planeIndex2 = (picmetadata->height * picmetadata->width / 4) * (plane + 1) + y * (picmetadata->width / 4) + x;
-								uint8_t inputPixel2 = picData[planeIndex2];
-								uint8_t* rgb2 = &wolfPalette[inputPixel2 * 3];
-								
-								rgbmerge[0] = (rgb[0] + rgb2[0]) / 2;
-								rgbmerge[1] = (rgb[1] + rgb2[1]) / 2;
-								rgbmerge[2] = (rgb[2] + rgb2[2]) / 2;
-
-								int patternMatch = FindClosestPaletteEntry(rgbmerge, cgaPalette, 16);
-								if(plane == 0)
-								{
-									pixels |= (patternMatch << 4);
-								}
-								else if(plane == 2)
-								{
-									pixels |= (patternMatch);
-								}
-							}
-							
-						}
-						else if(gfxMode == INVERT_MONO)
-						{
-							int patternMatch = MatchLCDPattern(rgb);
-							uint8_t pattern = (y & 1) ? lcdPatternsShifted[patternMatch] : lcdPatterns[patternMatch];
-							uint8_t mask = 0xc0 >> (plane * 2);
-							pixels |= (mask & pattern);
-						}
-						else if (gfxMode == CGA_RGB)
-						{
-							int patternMatch = FindClosestPaletteEntry(rgb, patternsRGB, NUM_PATTERNS, patternsRGBWeights);
-							int patternIndex = 0;
-
-							if (y & 1)
-							{
-								patternIndex = patternsShifted[patternMatch * 4 + plane];
-							}
-							else
-							{
-								patternIndex = patterns[patternMatch * 4 + plane];
-							}
-
-							if(!ShouldDither(n))
-							{
-								patternIndex = FindClosestPaletteEntry(rgb, palette, 4);
-							}
-
-							pixels |= patternIndex << ((3 - plane) * 2);
-						}
-						else if(gfxMode == CGA_COMPOSITE)
-						{
-							int patternMatch = FindClosestPaletteEntry(rgb, compositePalette, 16);
-							uint8_t doubled = patternMatch | (patternMatch << 4);
-							
-							uint8_t mask = 0xc0 >> (plane * 2);
-							pixels |= (mask & doubled);
-							/*if(plane == 0)
-							{
-								pixels |= (patternMatch << 4);
-							}
-							else if(plane == 2)
-							{
-								pixels |= patternMatch;
-							}*/
-							
-						}
-						else
-						{
-							int patternMatch = FindClosestPaletteEntry(rgb, compositePatternRGB, 256, compositePatternRGBWeights);
-							uint8_t mask = 0x2 << ((3 - plane) * 2);
-							pixels |= (mask & patternMatch);
-						}
-					}
-
-					newPicData[y * (picmetadata->width / 4) + x] = pixels;
-				}
+				(*used)[chunk] = true;
 			}
-
-			int bufferSpace = picmetadata->width * picmetadata->height * 4;
-			uint8_t* newCompressedData = new uint8_t[bufferSpace];
-			uint32_t* ptr = (uint32_t*)(newCompressedData);
-			*ptr = (picmetadata->width / 4) * picmetadata->height;
-			long compressedDataSize = HuffCompress(newPicData, (picmetadata->width / 4) * picmetadata->height, newCompressedData + 4, bufferSpace - 4, grhuffman);
-
-			if (0)
+		}
+		
+		tile = objects[n];
+		
+		if(tile >= FIRSTSTATICTILE && tile <= LASTSTATICTILE)
+		{
+			int chunk = header->spriteStart + SPR_STAT_0 + tile - FIRSTSTATICTILE;
+			if(chunk < header->soundStart)
 			{
-				if (compressedDataSize != chunks[n].dataSize - 4)
-				{
-					printf("Compressed size differs. Original: %d bytes New: %d bytes\n", chunks[n].dataSize - 4, compressedDataSize);
-				}
-
-				for (int x = 0; x < chunks[n].dataSize; x++)
-				{
-					if (chunks[n].data[x] != newCompressedData[x])
-					{
-						if (x >= compressedDataSize + 4)
-						{
-							printf("Byte %x Original: %x New: !\n", x, chunks[n].data[x]);
-						}
-						else
-						{
-							printf("Byte %x Original: %x New: %x\n", x, chunks[n].data[x], newCompressedData[x]);
-						}
-					}
-				}
+				(*used)[chunk] = true;
 			}
-
-			chunks[n].data = newCompressedData;
-			chunks[n].dataSize = compressedDataSize + 4;
-
-
-			//HuffExpand(newCompressedData + 4, picData, picmetadata->width * picmetadata->height, grhuffman);
 		}
 	}
+}
 
-	FILE* graphicsFileOut = fopen(isDemo ? gfxFilenameDemo[gfxMode] : gfxFilename[gfxMode], "wb");
-	uint32_t totalGraphicsFileLength = 0;
-	for (int n = 0; n < numChunks; n++)
+void OpenMapFiles(MappedFile* mapHead, MappedFile* mapFile)
+{
+	if(!MapFile(isDemo ? "MAPHEAD.WL1" : "MAPHEAD.WL6", mapHead) || mapHead->size < 2 + NUMMAPS * 4)
 	{
-		fwrite(chunks[n].data, 1, chunks[n].dataSize, graphicsFileOut);
-		chunks[n].headerOffset = totalGraphicsFileLength;
-		totalGraphicsFileLength += chunks[n].dataSize;
+		printf(isDemo ? "Could not open MAPHEAD.WL1\n" : "Could not open MAPHEAD.WL6\n");
+		exit(1);
 	}
-	fclose(graphicsFileOut);
-
-	FILE* dictFileOut = fopen(isDemo ? "CGADICT.WL1" : "CGADICT.WL6", "wb");
-	fwrite(grhuffman, sizeof(grhuffman), 1, dictFileOut);
-	fclose(dictFileOut);
-
-	FILE* graphicsHeadOut = fopen(isDemo ? headFilenameDemo[gfxMode] : headFilename[gfxMode], "wb");
-	for (int n = 0; n < numChunks; n++)
+	if(!MapFile(isDemo ? "GAMEMAPS.WL1" : "GAMEMAPS.WL6", mapFile))
 	{
-		uint32_t offset = chunks[n].headerOffset;
+		printf(isDemo ? "Could not open GAMEMAPS.WL1\n" : "Could not open GAMEMAPS.WL6\n");
+		exit(1);
+	}
+}
 
-		for (int n = 0; n < 3; n++)
+void BuildChunkLayout(const uint8_t* swapData)
+{
+	VSwapHeader header;
+	ReadVSwapHeader(swapData, &header);
+	
+	MappedFile mapHead, mapFile;
+	OpenMapFiles(&mapHead, &mapFile);
+	
+	uint16_t rlewTag = *(const uint16_t*) mapHead.data;
+	const uint32_t* headerOffsets = (const uint32_t*)(mapHead.data + 2);
+	
+	vector<vector<bool>> levelUsage;
+	vector<int> useCount(header.numChunks, 0);
+	uint16_t walls[MAPSIZE * MAPSIZE];
+	uint16_t objects[MAPSIZE * MAPSIZE];
+	
+	for(int map = 0; map < NUMMAPS; map++)
+	{
+		uint32_t pos = headerOffsets[map];
+		
+		// maptype: planestart[3], planelength[3], width, height, name[16]
+		if(!pos || pos == 0xffffffff || pos + 38 > (uint32_t) mapFile.size)
 		{
-			uint8_t writeOut = (uint8_t)(offset & 0xff);
-			fwrite(&writeOut, 1, 1, graphicsHeadOut);
-			offset >>= 8;
+			continue;
+		}
+		
+		const uint32_t* planeStart = (const uint32_t*)(mapFile.data + pos);
+		const uint16_t* planeLength = (const uint16_t*)(mapFile.data + pos + 12);
+		
+		ExpandMapPlane(&mapFile, planeStart[0], planeLength[0], rlewTag, walls);
+		ExpandMapPlane(&mapFile, planeStart[1], planeLength[1], rlewTag, objects);
+		
+		levelUsage.push_back(vector<bool>());
+		GetLevelChunkUsage(&header, walls, objects, &levelUsage.back());
+		
+		for(int n = 0; n < header.numChunks; n++)
+		{
+			useCount[n] += levelUsage.back()[n];
 		}
 	}
+	
+	UnmapFile(&mapHead);
+	UnmapFile(&mapFile);
+	
+	vector<int> fileOrder;
+	GetChunkFileOrder(&header, &fileOrder);
+	
+	vector<bool> placed(header.numChunks, false);
+	chunkLayout.clear();
+	
+	// Shared by most of the levels
+	for(int i = 0; i < fileOrder.size(); i++)
 	{
-		uint32_t offset = totalGraphicsFileLength;
-
-		for (int n = 0; n < 3; n++)
+		int n = fileOrder[i];
+		if(useCount[n] * 2 > (int) levelUsage.size())
 		{
-			uint8_t writeOut = (uint8_t)(offset & 0xff);
-			fwrite(&writeOut, 1, 1, graphicsHeadOut);
-			offset >>= 8;
+			chunkLayout.push_back(n);
+			placed[n] = true;
 		}
 	}
-	fclose(graphicsHeadOut);
-}
-
-void GenerateSignon()
-{
-	vector<uint8_t> pixels;
-	unsigned width, height;
-
-	printf("Generating signon..\n");
+	int sharedChunks = chunkLayout.size();
 	
-	if(lodepng::decode(pixels, width, height, "signon.png"))
+	// First used by each level in turn
+	for(int level = 0; level < levelUsage.size(); level++)
 	{
-		printf("Could not load signon.png - skipping\n");
-		return;
+		for(int i = 0; i < fileOrder.size(); i++)
+		{
+			int n = fileOrder[i];
+			if(levelUsage[level][n] && !placed[n])
+			{
+				chunkLayout.push_back(n);
+				placed[n] = true;
+			}
+		}
+	}
+	int levelChunks = chunkLayout.size() - sharedChunks;
+	
+	// Everything else
+	for(int i = 0; i < fileOrder.size(); i++)
+	{
+		int n = fileOrder[i];
+		if(!placed[n])
+		{
+			chunkLayout.push_back(n);
+		}
+	}
+	
+	printf("Chunk layout: %d levels, %d shared chunks, %d level chunks, %d others\n", (int) levelUsage.size(), sharedChunks, levelChunks, (int)(chunkLayout.size() - sharedChunks - levelChunks));
+}
+
+//
+// Expanded maps.  FASTHEAD/FASTMAPS are MAPHEAD/GAMEMAPS with the wall and
+// object planes stored as they are in memory, so CA_CacheMap can read each
+// one straight into its mapsegs buffer with no expansion and no temporary
+// buffers.  The RLEW tag in the header is set to EXPANDED_MAP_TAG to mark
+// them: 0 is the most common tile value, so no real map file uses it as its
+// tag.  The third plane isn't used by the engine and is left out.  The
+// length of the GAMEMAPS they were made from is appended to FASTHEAD, and
+// the engine ignores them if GAMEMAPS no longer has that length
+//
+#define EXPANDED_MAP_TAG 0
+#define EXPANDED_PLANES 2
+#define MAPTYPE_SIZE 38
+
+void GenerateExpandedMaps()
+{
+	const char* headFilename = isDemo ? "FASTHEAD.WL1" : "FASTHEAD.WL6";
+	const char* mapsFilename = isDemo ? "FASTMAPS.WL1" : "FASTMAPS.WL6";
+	
+	printf("Generating %s and %s..\n", headFilename, mapsFilename);
+	
+	MappedFile mapHead, mapFile;
+	OpenMapFiles(&mapHead, &mapFile);
+	
+	uint16_t rlewTag = *(const uint16_t*) mapHead.data;
+	const uint32_t* headerOffsets = (const uint32_t*)(mapHead.data + 2);
+	
+	vector<uint8_t> newHead(mapHead.data, mapHead.data + mapHead.size);
+	uint32_t* newHeaderOffsets = (uint32_t*)(newHead.data() + 2);
+	*(uint16_t*) newHead.data() = EXPANDED_MAP_TAG;
+	
+	FILE* fs = fopen(mapsFilename, "wb");
+	if(!fs)
+	{
+		printf("Could not open %s for writing\n", mapsFilename);
+		exit(1);
+	}
+	
+	// Keep the TED5 signature
+	uint32_t pos = min((uint32_t) mapFile.size, (uint32_t) 8);
+	fwrite(mapFile.data, 1, pos, fs);
+	
+	uint16_t plane[MAPSIZE * MAPSIZE];
+	
+	for(int map = 0; map < NUMMAPS; map++)
+	{
+		uint32_t sourcePos = headerOffsets[map];
+		
+		if(!sourcePos || sourcePos == 0xffffffff || sourcePos + MAPTYPE_SIZE > (uint32_t) mapFile.size)
+		{
+			continue;
+		}
+		
+		uint8_t mapType[MAPTYPE_SIZE];
+		uint32_t* planeStart = (uint32_t*)(mapType);
+		uint16_t* planeLength = (uint16_t*)(mapType + 12);
+		memcpy(mapType, mapFile.data + sourcePos, MAPTYPE_SIZE);
+		
+		newHeaderOffsets[map] = pos;
+		pos += MAPTYPE_SIZE;
+		
+		uint32_t sourcePlaneStart[3];
+		uint16_t sourcePlaneLength[3];
+		memcpy(sourcePlaneStart, planeStart, sizeof(sourcePlaneStart));
+		memcpy(sourcePlaneLength, planeLength, sizeof(sourcePlaneLength));
+		
+		for(int n = 0; n < 3; n++)
+		{
+			planeStart[n] = n < EXPANDED_PLANES ? pos + n * sizeof(plane) : 0;
+			planeLength[n] = n < EXPANDED_PLANES ? sizeof(plane) : 0;
+		}
+		fwrite(mapType, 1, MAPTYPE_SIZE, fs);
+		
+		for(int n = 0; n < EXPANDED_PLANES; n++)
+		{
+			ExpandMapPlane(&mapFile, sourcePlaneStart[n], sourcePlaneLength[n], rlewTag, plane);
+			fwrite(plane, 1, sizeof(plane), fs);
+			pos += sizeof(plane);
+		}
+	}
+	
+	fclose(fs);
+	
+	fs = fopen(headFilename, "wb");
+	if(!fs)
+	{
+		printf("Could not open %s for writing\n", headFilename);
+		exit(1);
+	}
+	fwrite(newHead.data(), 1, newHead.size(), fs);
+	uint32_t sourceLength = (uint32_t) mapFile.size;
+	fwrite(&sourceLength, 1, sizeof(sourceLength), fs);
+	fclose(fs);
+	
+	UnmapFile(&mapHead);
+	UnmapFile(&mapFile);
+}
+
+//
+// The order chunks are written to the converted page files in
+//
+void GetChunkWriteOrder(VSwapHeader* header, vector<int>* chunkOrder)
+{
+	if(chunkLayout.size())
+	{
+		*chunkOrder = chunkLayout;
+	}
+	else
+	{
+		GetChunkFileOrder(header, chunkOrder);
+	}
+}
+
+//
+// Writes an output file as the mapped source file with some byte ranges
+// replaced, so the source never has to be copied.  Patches must be written
+// in file order
+//
+struct PatchWriter
+{
+	FILE* fs;
+	const uint8_t* source;
+	uint32_t pos;
+};
+
+void OpenPatchWriter(PatchWriter* writer, const char* filename, const uint8_t* source)
+{
+	writer->fs = fopen(filename, "wb");
+	if(!writer->fs)
+	{
+		printf("Could not open %s for writing\n", filename);
+		exit(1);
+	}
+	writer->source = source;
+	writer->pos = 0;
+}
+
+void PatchCopyTo(PatchWriter* writer, uint32_t offset)
+{
+	if(offset > writer->pos)
+	{
+		fwrite(writer->source + writer->pos, 1, offset - writer->pos, writer->fs);
+		writer->pos = offset;
+	}
+}
+
+void PatchWrite(PatchWriter* writer, const uint8_t* data, uint32_t length)
+{
+	fwrite(data, 1, length, writer->fs);
+	writer->pos += length;
+}
+
+void ClosePatchWriter(PatchWriter* writer)
+{
+	fclose(writer->fs);
+}
+
+//
+// ESWAP layout.  The page file header is the same as VSWAP but every chunk
+// has been split into the four EGA bit planes ahead of time, most
+// significant bit first, so the engine only ever selects a plane and copies:
+//
+// Walls are 2048 bytes, column major: each of the 64 columns is 32 bytes,
+// an 8 byte slice for each plane in turn with one bit per texel from the top
+// of the column down.  A wall post is then one contiguous 32 byte run, and
+// the EGA scaler can set the map mask once per plane and draw that slice.
+//
+// Sprites are precompiled into opaque spans so the scaler never looks at a
+// transparent texel or walks the VGA posts:
+//
+//	leftpix, rightpix		as in VSWAP
+//	columnofs[rightpix - leftpix + 1]	offset of each column's span list
+//	span lists			top, height (bytes) and data offset (word) for
+//					each run of opaque texels, ended by a 0 word
+//	span data			four planes of (height + 7) / 8 bytes each, bit 7
+//					of a plane's first byte being the top texel
+//
+// so a span is drawn by setting the map mask once per plane and storing that
+// plane's bits down the column, with no transparency test per texel.
+//
+#define PLANAR_COLUMN_SIZE (4 * 8)
+#define PLANAR_WALL_SIZE (64 * PLANAR_COLUMN_SIZE)
+#define PAGE_ALIGN 512
+#define SPAN_SPRITE_MAX 4096		// a chunk has to fit in one ID_PM page
+
+void SplitWallPlanes(const uint8_t* src, uint8_t* dest)
+{
+	memset(dest, 0, PLANAR_WALL_SIZE);
+	
+	for(int column = 0; column < 64; column++)
+	{
+		for(int texel = 0; texel < 64; texel++)
+		{
+			uint8_t colour = convertLUTEGA[src[column * 64 + texel]];
+			uint8_t bit = 0x80 >> (texel & 7);
+			
+			for(int plane = 0; plane < 4; plane++)
+			{
+				if(colour & (1 << plane))
+				{
+					dest[column * PLANAR_COLUMN_SIZE + plane * 8 + texel / 8] |= bit;
+				}
+			}
+		}
+	}
+}
+
+void BuildSpanSprite(int chunkNumber, const uint8_t* shape, int length, vector<uint8_t>* out)
+{
+	const uint16_t* shapeWords = (const uint16_t*) shape;
+	int leftpix = shapeWords[0];
+	int rightpix = shapeWords[1];
+	int numColumns = rightpix - leftpix + 1;
+	
+	out->assign(4 + 2 * numColumns, 0);
+	*(uint16_t*)(out->data()) = (uint16_t) leftpix;
+	*(uint16_t*)(out->data() + 2) = (uint16_t) rightpix;
+	
+	vector<uint8_t> spanData;
+	vector<int> dataFixups;
+	
+	for(int column = 0; column < numColumns; column++)
+	{
+		// Expand the column's posts to texels, -1 being transparent
+		int texels[64];
+		for(int y = 0; y < 64; y++)
+		{
+			texels[y] = -1;
+		}
+		
+		int post = shapeWords[2 + column];
+		
+		while(post + 6 <= length && *(const uint16_t*)(shape + post))
+		{
+			int endy = *(const uint16_t*)(shape + post) / 2;
+			int pixels = (int16_t) *(const uint16_t*)(shape + post + 2);
+			int starty = *(const uint16_t*)(shape + post + 4) / 2;
+			
+			for(int y = starty; y < endy && y < 64; y++)
+			{
+				if(pixels + y < 0 || pixels + y >= length)
+				{
+					printf("Sprite chunk %d has a post outside the chunk\n", chunkNumber);
+					exit(1);
+				}
+				texels[y] = shape[pixels + y];
+			}
+			post += 6;
+		}
+		
+		*(uint16_t*)(out->data() + 4 + 2 * column) = (uint16_t) out->size();
+		
+		for(int top = 0; top < 64; )
+		{
+			if(texels[top] == -1)
+			{
+				top++;
+				continue;
+			}
+			
+			int height = 0;
+			while(top + height < 64 && texels[top + height] != -1)
+			{
+				height++;
+			}
+			
+			int stride = (height + 7) / 8;
+			int dataOffset = (int) spanData.size();
+			spanData.resize(dataOffset + 4 * stride, 0);
+			
+			for(int y = 0; y < height; y++)
+			{
+				uint8_t colour = convertLUTEGA[texels[top + y]];
+				uint8_t bit = 0x80 >> (y & 7);
+				
+				for(int plane = 0; plane < 4; plane++)
+				{
+					if(colour & (1 << plane))
+					{
+						spanData[dataOffset + plane * stride + y / 8] |= bit;
+					}
+				}
+			}
+			
+			// The data offset is filled in once the span lists are all out
+			dataFixups.push_back((int) out->size() + 2);
+			out->push_back((uint8_t) top);
+			out->push_back((uint8_t) height);
+			out->push_back((uint8_t) dataOffset);
+			out->push_back((uint8_t)(dataOffset >> 8));
+			
+			top += height;
+		}
+		
+		out->push_back(0);
+		out->push_back(0);
+	}
+	
+	int dataStart = (int) out->size();
+	
+	for(int i = 0; i < dataFixups.size(); i++)
+	{
+		*(uint16_t*)(out->data() + dataFixups[i]) += (uint16_t) dataStart;
+	}
+	out->insert(out->end(), spanData.begin(), spanData.end());
+	
+	if(out->size() > SPAN_SPRITE_MAX)
+	{
+		printf("Sprite chunk %d is too large as spans\n", chunkNumber);
+		exit(1);
+	}
+}
+
+//
+// Writes a page file with its chunks in the given order, each one starting
+// on a PAGE_ALIGN boundary.  chunkLength(n) gives the length chunk n will
+// have and convertChunk(n, chunk) fills it in
+//
+template<typename ChunkLength, typename ConvertChunk>
+void WritePageFile(const char* filename, const uint8_t* data, VSwapHeader* header, const vector<int>& chunkOrder, ChunkLength chunkLength, ConvertChunk convertChunk)
+{
+	if(!chunkOrder.size())
+	{
+		printf("No chunks in page file\n");
+		exit(1);
+	}
+	
+	// The header and its padding go out unchanged apart from the offsets and
+	// lengths, so work out where everything will end up first
+	uint32_t headerLength = header->chunkOffsets[chunkOrder[0]];
+	for(int i = 1; i < chunkOrder.size(); i++)
+	{
+		headerLength = min(headerLength, header->chunkOffsets[chunkOrder[i]]);
+	}
+	
+	uint8_t* newHeader = new uint8_t[headerLength];
+	memcpy(newHeader, data, headerLength);
+	
+	uint32_t* newChunkOffsets = (uint32_t*)(newHeader + 6);
+	uint16_t* newChunkLengths = (uint16_t*)(newChunkOffsets + header->numChunks);
+	uint32_t writePos = headerLength;
+	
+	for(int i = 0; i < chunkOrder.size(); i++)
+	{
+		int n = chunkOrder[i];
+		uint32_t length = chunkLength(n);
+		
+		newChunkOffsets[n] = writePos;
+		newChunkLengths[n] = (uint16_t) length;
+		writePos = (writePos + length + PAGE_ALIGN - 1) & ~(PAGE_ALIGN - 1);
+	}
+	
+	FILE* fs = fopen(filename, "wb");
+	if(!fs)
+	{
+		printf("Could not open %s for writing\n", filename);
+		exit(1);
+	}
+	fwrite(newHeader, 1, headerLength, fs);
+	
+	uint8_t chunk[65536];
+	uint8_t padding[PAGE_ALIGN];
+	uint32_t pos = headerLength;
+	
+	memset(padding, 0, sizeof(padding));
+	
+	for(int i = 0; i < chunkOrder.size(); i++)
+	{
+		int n = chunkOrder[i];
+		
+		fwrite(padding, 1, newChunkOffsets[n] - pos, fs);
+		pos = newChunkOffsets[n];
+		
+		convertChunk(n, chunk);
+		
+		fwrite(chunk, 1, newChunkLengths[n], fs);
+		pos += newChunkLengths[n];
+	}
+	
+	fclose(fs);
+	
+	delete[] newHeader;
+}
+
+void GeneratePlanarDataFile(const char* filename, const uint8_t* data, int dataLength)
+{
+	VSwapHeader header;
+	ReadVSwapHeader(data, &header);
+	
+	// Walls are read as whole 64x64 textures, so check every page is really
+	// in the file before reading any of them
+	for(int n = 0; n < header.soundStart; n++)
+	{
+		uint32_t readLength = n < header.spriteStart ? 64 * 64 : header.chunkLengths[n];
+		
+		if(header.chunkLengths[n] && header.chunkOffsets[n] + readLength > (uint32_t) dataLength)
+		{
+			printf("Page %d runs past the end of the VSWAP file\n", n);
+			exit(1);
+		}
+	}
+	
+	vector<int> chunkOrder;
+	GetChunkWriteOrder(&header, &chunkOrder);
+	
+	// Span sprites change size, so build them before anything is laid out
+	vector<vector<uint8_t> > spanSprites(header.numChunks);
+	
+	for(int n = header.spriteStart; n < header.soundStart; n++)
+	{
+		const uint8_t* chunkPtr = data + header.chunkOffsets[n];
+		const uint16_t* spritePtr = (const uint16_t*)(chunkPtr);
+		uint16_t leftpix = spritePtr[0];
+		uint16_t rightpix = spritePtr[1];
+		
+		if(header.chunkLengths[n] >= 4 && leftpix < 64 && rightpix < 64 && leftpix <= rightpix)
+		{
+			BuildSpanSprite(n, chunkPtr, header.chunkLengths[n], &spanSprites[n]);
+		}
+	}
+	
+	WritePageFile(filename, data, &header, chunkOrder, [&](int n)
+	{
+		if(n < header.spriteStart)
+		{
+			return (uint32_t) PLANAR_WALL_SIZE;
+		}
+		return spanSprites[n].size() ? (uint32_t) spanSprites[n].size() : (uint32_t) header.chunkLengths[n];
+	},
+	[&](int n, uint8_t* chunk)
+	{
+		const uint8_t* chunkPtr = data + header.chunkOffsets[n];
+		
+		if(n < header.spriteStart)
+		{
+			// This is a texture
+			SplitWallPlanes(chunkPtr, chunk);
+		}
+		else if(spanSprites[n].size())
+		{
+			// This is a sprite
+			memcpy(chunk, spanSprites[n].data(), spanSprites[n].size());
+		}
+		else
+		{
+			memcpy(chunk, chunkPtr, header.chunkLengths[n]);
+		}
+	});
+}
+
+//
+// Pic conversion tables.  Each entry is the bits a VGA pixel in the given
+// plane contributes to the packed output byte, for [mode][dither][row & 1].
+// Tandy averages each pair of pixels so it is looked up by both indices
+//
+uint8_t picLUT[NUM_GFX_MODES][2][2][4][256];
+uint8_t tandyPairLUT[256 * 256];
+
+void GeneratePicLUTs()
+{
+	for(int index = 0; index < 256; index++)
+	{
+		uint8_t* rgb = &wolfPalette[index * 3];
+		int patternMatch = FindClosestPaletteEntry(rgb, patternsRGB, NUM_PATTERNS, patternsRGBWeights);
+		int closestMatch = FindClosestPaletteEntry(rgb, palette, 4);
+		int compositeMatch = FindClosestPaletteEntry(rgb, compositePalette, 16);
+		uint8_t compositeDoubled = compositeMatch | (compositeMatch << 4);
+		int lcdMatch = MatchLCDPattern(rgb);
+		
+		for(int plane = 0; plane < 4; plane++)
+		{
+			uint8_t mask = 0xc0 >> (plane * 2);
+			int shift = (3 - plane) * 2;
+			
+			for(int row = 0; row < 2; row++)
+			{
+				uint8_t* rowPatterns = row ? patternsShifted : patterns;
+				uint8_t lcdPattern = row ? lcdPatternsShifted[lcdMatch] : lcdPatterns[lcdMatch];
+				
+				picLUT[CGA_RGB][0][row][plane][index] = closestMatch << shift;
+				picLUT[CGA_RGB][1][row][plane][index] = rowPatterns[patternMatch * 4 + plane] << shift;
+				
+				for(int dither = 0; dither < 2; dither++)
+				{
+					picLUT[CGA_COMPOSITE][dither][row][plane][index] = mask & compositeDoubled;
+					picLUT[INVERT_MONO][dither][row][plane][index] = mask & lcdPattern;
+				}
+			}
+		}
+	}
+	
+	for(int first = 0; first < 256; first++)
+	{
+		uint8_t* rgb = &wolfPalette[first * 3];
+		
+		for(int second = 0; second < 256; second++)
+		{
+			uint8_t* rgb2 = &wolfPalette[second * 3];
+			uint8_t rgbmerge[3];
+			
+			rgbmerge[0] = (rgb[0] + rgb2[0]) / 2;
+			rgbmerge[1] = (rgb[1] + rgb2[1]) / 2;
+			rgbmerge[2] = (rgb[2] + rgb2[2]) / 2;
+			
+			tandyPairLUT[first * 256 + second] = (uint8_t) FindClosestPaletteEntry(rgbmerge, cgaPalette, 16);
+		}
+	}
+}
+
+//
+// The byte range of a chunk that holds pixels to convert.  Returns false for
+// chunks that are left as they are
+//
+bool GetChunkPatchRange(VSwapHeader* header, int n, const uint8_t* chunkPtr, uint32_t* patchStart, uint32_t* patchEnd)
+{
+	if(n < header->spriteStart)
+	{
+		// This is a texture
+		*patchStart = 0;
+		*patchEnd = header->chunkLengths[n];
+		return true;
+	}
+	
+	if(n < header->soundStart)
+	{
+		// This is a sprite
+		const uint16_t* spritePtr = (const uint16_t*)(chunkPtr);
+		uint16_t leftpix = *spritePtr++;
+		uint16_t rightpix = *spritePtr++;
+
+		if (leftpix >= 64 || rightpix >= 64 || leftpix > rightpix)
+		{
+			return false;
+		}
+		uint16_t firstTableDataOffset = *spritePtr;
+		int numTables = rightpix - leftpix + 1;
+		
+		*patchStart = 2 * numTables + 4;
+		*patchEnd = firstTableDataOffset;
+		return true;
+	}
+	
+	// Sounds are left as they are
+	return false;
+}
+
+void GenerateDataFile(const char* filename, const uint8_t* data, int dataLength, uint8_t* conversionTable)
+{
+	VSwapHeader header;
+	ReadVSwapHeader(data, &header);
+	
+	if(chunkLayout.size())
+	{
+		WritePageFile(filename, data, &header, chunkLayout, [&](int n)
+		{
+			return (uint32_t) header.chunkLengths[n];
+		},
+		[&](int n, uint8_t* chunk)
+		{
+			const uint8_t* chunkPtr = data + header.chunkOffsets[n];
+			uint32_t patchStart, patchEnd;
+			
+			memcpy(chunk, chunkPtr, header.chunkLengths[n]);
+			
+			if(GetChunkPatchRange(&header, n, chunkPtr, &patchStart, &patchEnd))
+			{
+				for(uint32_t x = patchStart; x < patchEnd; x++)
+				{
+					chunk[x] = conversionTable[chunkPtr[x]];
+				}
+			}
+		});
+		return;
+	}
+	
+	vector<int> chunkOrder;
+	GetChunkFileOrder(&header, &chunkOrder);
+	
+	PatchWriter writer;
+	OpenPatchWriter(&writer, filename, data);
+	
+	uint8_t patch[65536];
+	
+	for(int i = 0; i < chunkOrder.size(); i++)
+	{
+		int n = chunkOrder[i];
+		const uint8_t* chunkPtr = data + header.chunkOffsets[n];
+		uint32_t patchStart, patchEnd;
+		
+		if(!GetChunkPatchRange(&header, n, chunkPtr, &patchStart, &patchEnd))
+		{
+			continue;
+		}
+		
+		for(uint32_t x = patchStart; x < patchEnd; x++)
+		{
+			patch[x - patchStart] = conversionTable[chunkPtr[x]];
+		}
+		
+		PatchCopyTo(&writer, header.chunkOffsets[n] + patchStart);
+		PatchWrite(&writer, patch, patchEnd - patchStart);
+	}
+	
+	PatchCopyTo(&writer, dataLength);
+	ClosePatchWriter(&writer);
+}
+
+#define STARTPICS    3
+#define NUMPICSDEMO      144
+#define NUMPICSFULL      132
+#define NUMPICS (isDemo ? NUMPICSDEMO : NUMPICSFULL)
+#define STARTTILE8 (STARTPICS + NUMPICS)
+#define NUMTILE8DEMO 35
+#define NUMTILE8FULL 72
+#define NUMTILE8 (isDemo ? NUMTILE8DEMO : NUMTILE8FULL)
+
+struct GraphChunk
+{
+	uint8_t* data;
+	uint32_t dataSize;
+	uint32_t uncompressedSize;
+	uint8_t* uncompressedData;
+	uint32_t headerOffset;
+};
+
+//
+// VGA graphics, loaded and expanded once and then only read from while the
+// targets are converted
+//
+struct SourceGraphics
+{
+	huffnode dictionary[255];
+	huffcodebook codebook;
+	int numChunks;
+	GraphChunk* chunks;
+	MappedFile graphicsFile;
+} sourceGraphics;
+
+//
+// Converted chunks for one target.  data is what gets written out,
+// uncompressedData the packed pixels for pics and the expanded source for
+// everything else
+//
+struct TargetGraphics
+{
+	GraphChunk* chunks;
+	huffnode dictionary[255];
+} targetGraphics[NUM_GFX_MODES];
+
+//
+// Build cache.  Converted pics are kept in a file keyed by a hash of
+// everything their conversion depends on, so a rebuild only has to expand,
+// convert and compress the pics that changed.  Bump BUILD_CACHE_VERSION
+// whenever the conversion itself changes
+//
+#define BUILD_CACHE_FILENAME "CGAIFY.CCH"
+#define BUILD_CACHE_VERSION 1
+
+struct BuildCacheEntry
+{
+	uint32_t dataSize;
+	uint32_t uncompressedSize;
+	uint8_t* data;
+	uint8_t* uncompressedData;
+};
+
+bool useBuildCache = false;
+map<uint64_t, BuildCacheEntry> buildCache;
+atomic<int> buildCacheHits(0);
+
+//
+// The palette and every table the pic conversion looks colours up in, so a
+// new wolfpal.png or pattern change doesn't reuse stale pics.  Worked out
+// once the tables are built, by LoadBuildCache
+//
+uint64_t conversionTablesHash;
+
+void HashConversionTables()
+{
+	uint64_t hash = HASH_START;
+	hash = HashBytes(hash, wolfPalette, sizeof(wolfPalette));
+	hash = HashBytes(hash, picLUT, sizeof(picLUT));
+	hash = HashBytes(hash, tandyPairLUT, sizeof(tandyPairLUT));
+	hash = HashBytes(hash, convertLUTEGA, sizeof(convertLUTEGA));
+	conversionTablesHash = hash;
+}
+
+uint64_t GetChunkCacheKey(CgaMode gfxMode, int n)
+{
+	pictabletype* pictable = (pictabletype*)(sourceGraphics.chunks[0].uncompressedData);
+	pictabletype* picmetadata = &pictable[n - STARTPICS];
+	GraphChunk* source = &sourceGraphics.chunks[n];
+	uint32_t settings[] =
+	{
+		BUILD_CACHE_VERSION,
+		(uint32_t) gfxMode,
+		ShouldDither(n) ? 1u : 0u,
+		(uint32_t) picmetadata->width,
+		(uint32_t) picmetadata->height
+	};
+	
+	uint64_t hash = HASH_START;
+	hash = HashBytes(hash, settings, sizeof(settings));
+	hash = HashBytes(hash, &conversionTablesHash, sizeof(conversionTablesHash));
+	hash = HashBytes(hash, sourceGraphics.dictionary, sizeof(sourceGraphics.dictionary));
+	hash = HashBytes(hash, source->data, source->dataSize);
+	return hash;
+}
+
+BuildCacheEntry* FindCachedChunk(CgaMode gfxMode, int n)
+{
+	if(!useBuildCache)
+	{
+		return NULL;
+	}
+	
+	map<uint64_t, BuildCacheEntry>::iterator it = buildCache.find(GetChunkCacheKey(gfxMode, n));
+	if(it == buildCache.end())
+	{
+		return NULL;
+	}
+	return &it->second;
+}
+
+void LoadBuildCache()
+{
+	MappedFile cacheFile;
+	
+	HashConversionTables();
+	
+	if(!MapFile(BUILD_CACHE_FILENAME, &cacheFile))
+	{
+		return;
+	}
+	
+	uint8_t* ptr = cacheFile.data;
+	uint8_t* end = cacheFile.data + cacheFile.size;
+	uint32_t* cacheHeader = (uint32_t*) ptr;
+	bool damaged = cacheFile.size < 8;
+	
+	if(!damaged && cacheHeader[0] == BUILD_CACHE_VERSION)
+	{
+		uint32_t numEntries = cacheHeader[1];
+		ptr += 8;
+		
+		for(uint32_t i = 0; i < numEntries && !damaged; i++)
+		{
+			if(end - ptr < 16)
+			{
+				damaged = true;
+				break;
+			}
+			
+			uint64_t key = *(uint64_t*) ptr;
+			BuildCacheEntry entry;
+			entry.dataSize = *(uint32_t*)(ptr + 8);
+			entry.uncompressedSize = *(uint32_t*)(ptr + 12);
+			ptr += 16;
+			
+			if((uint64_t)(end - ptr) < (uint64_t) entry.dataSize + entry.uncompressedSize)
+			{
+				damaged = true;
+				break;
+			}
+			
+			entry.data = new uint8_t[entry.dataSize];
+			memcpy(entry.data, ptr, entry.dataSize);
+			ptr += entry.dataSize;
+			entry.uncompressedData = new uint8_t[entry.uncompressedSize];
+			memcpy(entry.uncompressedData, ptr, entry.uncompressedSize);
+			ptr += entry.uncompressedSize;
+			
+			buildCache[key] = entry;
+		}
+	}
+	
+	if(damaged)
+	{
+		printf("Build cache is damaged, ignoring it\n");
+		buildCache.clear();
+	}
+	
+	UnmapFile(&cacheFile);
+}
+
+//
+// Writes out the pics from this run, with the VGA dictionary compression,
+// so entries for pics that have since changed are dropped
+//
+void SaveBuildCache()
+{
+	FILE* cacheFile = fopen(BUILD_CACHE_FILENAME, "wb");
+	
+	if(!cacheFile)
+	{
+		printf("Could not write build cache\n");
+		return;
+	}
+	
+	uint32_t cacheHeader[2] = { BUILD_CACHE_VERSION, (uint32_t)(NUM_GFX_MODES * NUMPICS) };
+	fwrite(cacheHeader, sizeof(cacheHeader), 1, cacheFile);
+	
+	for(int mode = 0; mode < NUM_GFX_MODES; mode++)
+	{
+		for(int n = STARTPICS; n < STARTPICS + NUMPICS; n++)
+		{
+			GraphChunk* chunk = &targetGraphics[mode].chunks[n];
+			uint64_t key = GetChunkCacheKey((CgaMode) mode, n);
+			
+			fwrite(&key, sizeof(key), 1, cacheFile);
+			fwrite(&chunk->dataSize, sizeof(chunk->dataSize), 1, cacheFile);
+			fwrite(&chunk->uncompressedSize, sizeof(chunk->uncompressedSize), 1, cacheFile);
+			fwrite(chunk->data, 1, chunk->dataSize, cacheFile);
+			fwrite(chunk->uncompressedData, 1, chunk->uncompressedSize, cacheFile);
+		}
+	}
+	
+	fclose(cacheFile);
+}
+
+bool IsPic(int n)
+{
+	return n >= STARTPICS && n < STARTPICS + NUMPICS;
+}
+
+bool ShouldExpandChunk(int n)
+{
+	// The pictable and fonts are needed by every target, and pics unless all
+	// of their conversions are in the build cache.  The rest only get expanded
+	// to recompress them with a target's own dictionary
+	if(n < STARTPICS)
+	{
+		return true;
+	}
+	if(IsPic(n))
+	{
+		if(!useBuildCache || verifyRecompress)
+		{
+			return true;
+		}
+		for(int mode = 0; mode < NUM_GFX_MODES; mode++)
+		{
+			if(!FindCachedChunk((CgaMode) mode, n))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	return optimiseDictionaries;
+}
+
+void ExpandChunk(int n, huffdecodetable* decodetable)
+{
+	GraphChunk* chunk = &sourceGraphics.chunks[n];
+	
+	if(n == STARTTILE8)
+	{
+		// Tile 8s are all in one chunk with an implicit size
+		chunk->uncompressedSize = 64 * NUMTILE8;
+		chunk->uncompressedData = new uint8_t[chunk->uncompressedSize];
+		HuffExpand(chunk->data, chunk->dataSize, chunk->uncompressedData, chunk->uncompressedSize, decodetable);
+	}
+	else
+	{
+		chunk->uncompressedSize = *(uint32_t*)(chunk->data);
+		chunk->uncompressedData = new uint8_t[chunk->uncompressedSize];
+		HuffExpand(chunk->data + 4, chunk->dataSize - 4, chunk->uncompressedData, chunk->uncompressedSize, decodetable);
+	}
+}
+
+void LoadSourceGraphics()
+{
+	FILE* dictionaryFile = fopen(isDemo ? "VGADICT.WL1" : "VGADICT.WL6", "rb");
+	if(!dictionaryFile)
+	{
+		printf("Could not open dictionary\n");
+		exit(1);
+	}
+	fread(sourceGraphics.dictionary, sizeof(sourceGraphics.dictionary), 1, dictionaryFile);
+	fclose(dictionaryFile);
+	
+	memcpy(grhuffman, sourceGraphics.dictionary, sizeof(grhuffman));
+	HuffBuildCodebook(sourceGraphics.dictionary, &sourceGraphics.codebook);
+
+	huffdecodetable* grdecodetable = new huffdecodetable;
+	HuffBuildDecodeTable(sourceGraphics.dictionary, grdecodetable);
+
+	FILE* headFile = fopen(isDemo ? "VGAHEAD.WL1" : "VGAHEAD.WL6", "rb");
+	
+	if(!headFile)
+	{
+		printf("Could not open head\n");
+		exit(1);
+	}
+
+	fseek(headFile, 0, SEEK_END);
+	long headerSize = ftell(headFile);
+    fseek(headFile, 0, SEEK_SET);
+	//printf("Header file size: %d bytes\n", headerSize);
+	
+	if(headerSize % 3)
+	{
+		printf("File size not multiple of 3?\n");
+		exit(1);
+	}
+	
+	int numChunks = (headerSize / 3) - 1;
+	
+	GraphChunk* chunks = new GraphChunk[numChunks];
+	
+	//printf("Num chunks: %d\n", numChunks);
+	
+	for(int n = 0; n < numChunks + 1; n++)
+	{
+		uint32_t offset = 0;
+		
+		for(int i = 0; i < 3; i++)
+		{
+			uint8_t offsetPart;
+			fread(&offsetPart, 1, 1, headFile);
+			offset |= (offsetPart << (i * 8));
+		}
+		
+		if(n < numChunks)
+		{
+			chunks[n].headerOffset = offset;
+		}
+		if(n > 0)
+		{
+			chunks[n - 1].dataSize = offset - chunks[n - 1].headerOffset;
+		}
+		
+		//printf("Chunk %d: offset: %x\n", n, offset);
+	}
+	
+	fclose(headFile);
+	
+	if(!MapFile(isDemo ? "VGAGRAPH.WL1" : "VGAGRAPH.WL6", &sourceGraphics.graphicsFile))
+	{
+		printf("Could not open graphics\n");
+		exit(1);
+	}
+	uint8_t* graphicsData = sourceGraphics.graphicsFile.data;
+	
+	sourceGraphics.numChunks = numChunks;
+	sourceGraphics.chunks = chunks;
+	
+	for(int n = 0; n < numChunks; n++)
+	{
+		chunks[n].data = graphicsData + chunks[n].headerOffset;
+		chunks[n].uncompressedSize = 0;
+		chunks[n].uncompressedData = NULL;
+	}
+	
+	// The pictable has to come first as the build cache keys need it
+	for(int n = 0; n < STARTPICS; n++)
+	{
+		ExpandChunk(n, grdecodetable);
+	}
+	
+	RunJobs(numChunks - STARTPICS, [&](int job)
+	{
+		int n = job + STARTPICS;
+		
+		if(ShouldExpandChunk(n))
+		{
+			ExpandChunk(n, grdecodetable);
+		}
+	});
+	
+	if(verifyRecompress)
+	{
+		for(int n = 0; n < STARTPICS + NUMPICS; n++)
+		{
+			uint8_t* treeWalkData = new uint8_t[chunks[n].uncompressedSize];
+			HuffExpandTreeWalk(chunks[n].data + 4, treeWalkData, chunks[n].uncompressedSize, grhuffman);
+			if(memcmp(treeWalkData, chunks[n].uncompressedData, chunks[n].uncompressedSize))
+			{
+				printf("Chunk %d: lookup decoder doesn't match tree walk decoder!\n", n);
+			}
+			delete[] treeWalkData;
+			TestRecompress(chunks[n].uncompressedData, chunks[n].uncompressedSize, chunks[n].data + 4, chunks[n].dataSize - 4, grhuffman);
+		}
+	}
+	
+	delete grdecodetable;
+}
+
+//
+// Splits a VGA pic into EGA bit planes, plane major, with each row padded up
+// to a whole byte
+//
+uint8_t* ConvertPicPlanar(int n, uint32_t* size)
+{
+	pictabletype* pictable = (pictabletype*)(sourceGraphics.chunks[0].uncompressedData);
+	pictabletype* picmetadata = &pictable[n - STARTPICS];
+	uint8_t* picData = sourceGraphics.chunks[n].uncompressedData;
+	int width = picmetadata->width;
+	int height = picmetadata->height;
+	int vgaPlaneSize = height * width / 4;
+	int rowBytes = (width + 7) / 8;
+	int planeSize = rowBytes * height;
+	
+	*size = planeSize * 4;
+	uint8_t* newPicData = new uint8_t[*size];
+	memset(newPicData, 0, *size);
+	
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			uint8_t colour = convertLUTEGA[picData[(x & 3) * vgaPlaneSize + y * (width / 4) + (x >> 2)]];
+			uint8_t bit = 0x80 >> (x & 7);
+			uint8_t* output = newPicData + y * rowBytes + (x >> 3);
+			
+			for (int plane = 0; plane < 4; plane++)
+			{
+				if (colour & (1 << plane))
+				{
+					output[plane * planeSize] |= bit;
+				}
+			}
+		}
+	}
+	
+	return newPicData;
+}
+
+uint8_t* ConvertPic(CgaMode gfxMode, int n, uint32_t* size)
+{
+	pictabletype* pictable = (pictabletype*)(sourceGraphics.chunks[0].uncompressedData);
+	pictabletype* picmetadata = &pictable[n - STARTPICS];
+	//printf("%d : %d x %d (%d bytes)\n", n, picmetadata->width, picmetadata->height, sourceGraphics.chunks[n].uncompressedSize);
+	
+	//if(n == 0)
+	if(0)
+	{
+		vector<uint8_t> rgbData;
+		rgbData.resize(picmetadata->width * picmetadata->height * 4);
+		uint8_t* picData = sourceGraphics.chunks[n].uncompressedData;
+		
+		int inputIndex = 0;
+		for(int plane = 0; plane < 4; plane++)
+		{
+			for(int y = 0; y < picmetadata->height; y++)
+			{
+				for(int x = 0; x < picmetadata->width / 4; x++)
+				{
+					int outputIndex = 4 * (y * picmetadata->width + (x * 4) + plane);
+					uint8_t indexColour = picData[inputIndex];
+					uint8_t* rgb = &wolfPalette[indexColour * 3];
+					int patternMatch = FindClosestPaletteEntry(rgb, patternsRGB, NUM_PATTERNS, patternsRGBWeights);
+					int patternIndex = 0;
+
+					if (y & 1)
+					{
+						patternIndex = patternsShifted[patternMatch * 4 + plane];
+					}
+					else
+					{
+						patternIndex = patterns[patternMatch * 4 + plane];
+					}
+
+					//patternIndex = FindClosestPaletteEntry(rgb, palette, 4);
+					
+					rgbData[outputIndex] = palette[patternIndex * 3];
+					rgbData[outputIndex + 1] = palette[patternIndex * 3 + 1];
+					rgbData[outputIndex + 2] = palette[patternIndex * 3 + 2];
+					rgbData[outputIndex + 3] = 255;
+					
+					inputIndex++;
+					
+					
+				}
+			}
+		}
+		
+		char filename[50];
+		sprintf(filename, "pic%d.png", n - STARTPICS);
+		lodepng::encode(filename, rgbData, picmetadata->width, picmetadata->height);
+	}
+
+	if(gfxMode == EGA_PLANAR)
+	{
+		return ConvertPicPlanar(n, size);
+	}
+
+	uint8_t* picData = sourceGraphics.chunks[n].uncompressedData;
+	uint8_t* newPicData = new uint8_t[picmetadata->width * picmetadata->height];
+	*size = (picmetadata->width / 4) * picmetadata->height;
+	int planeSize = picmetadata->height * picmetadata->width / 4;
+	int dither = ShouldDither(n) ? 1 : 0;
+	
+	for (int y = 0; y < picmetadata->height; y++)
+	{
+		uint8_t* plane0 = picData + y * (picmetadata->width / 4);
+		uint8_t* plane1 = plane0 + planeSize;
+		uint8_t* plane2 = plane1 + planeSize;
+		uint8_t* plane3 = plane2 + planeSize;
+		uint8_t* output = newPicData + y * (picmetadata->width / 4);
+		
+		if(gfxMode == TANDY160)
+		{
+			for (int x = 0; x < picmetadata->width / 4; x++)
+			{
+				output[x] = (tandyPairLUT[plane0[x] * 256 + plane1[x]] << 4) | tandyPairLUT[plane2[x] * 256 + plane3[x]];
+			}
+		}
+		else
+		{
+			uint8_t (*lut)[256] = picLUT[gfxMode][dither][y & 1];
+			
+			for (int x = 0; x < picmetadata->width / 4; x++)
+			{
+				output[x] = lut[0][plane0[x]] | lut[1][plane1[x]] | lut[2][plane2[x]] | lut[3][plane3[x]];
+			}
+		}
+	}
+
+	return newPicData;
+}
+
+void ConvertGraphicsChunk(CgaMode gfxMode, int n)
+{
+	GraphChunk* source = &sourceGraphics.chunks[n];
+	GraphChunk* chunk = &targetGraphics[gfxMode].chunks[n];
+	
+	*chunk = *source;
+
+	if(!IsPic(n))
+	{
+		// Not a pic, so the VGA data goes across as it is
+		return;
+	}
+	
+	BuildCacheEntry* cached = FindCachedChunk(gfxMode, n);
+	if(cached)
+	{
+		chunk->data = cached->data;
+		chunk->dataSize = cached->dataSize;
+		chunk->uncompressedData = cached->uncompressedData;
+		chunk->uncompressedSize = cached->uncompressedSize;
+		buildCacheHits++;
+		return;
+	}
+	
+	pictabletype* pictable = (pictabletype*)(sourceGraphics.chunks[0].uncompressedData);
+	pictabletype* picmetadata = &pictable[n - STARTPICS];
+	uint32_t newPicSize;
+	uint8_t* newPicData = ConvertPic(gfxMode, n, &newPicSize);
+
+	int bufferSpace = picmetadata->width * picmetadata->height * 4;
+	uint8_t* newCompressedData = new uint8_t[bufferSpace];
+	uint32_t* ptr = (uint32_t*)(newCompressedData);
+	*ptr = newPicSize;
+	long compressedDataSize = HuffCompress(newPicData, newPicSize, newCompressedData + 4, bufferSpace - 4, &sourceGraphics.codebook);
+
+	chunk->data = newCompressedData;
+	chunk->dataSize = compressedDataSize + 4;
+	chunk->uncompressedData = newPicData;
+	chunk->uncompressedSize = newPicSize;
+
+	//HuffExpand(newCompressedData + 4, picData, picmetadata->width * picmetadata->height, grhuffman);
+}
+
+//
+// Builds a dictionary from the target's own byte counts.  Node 254 stays the
+// head so the engine loads it the same way as the VGA one
+//
+void BuildTargetDictionary(CgaMode gfxMode)
+{
+	TargetGraphics* target = &targetGraphics[gfxMode];
+	long targetCounts[256];
+	
+	memset(targetCounts, 0, sizeof(targetCounts));
+	
+	for(int n = 0; n < sourceGraphics.numChunks; n++)
+	{
+		uint8_t* data = target->chunks[n].uncompressedData;
+		for(uint32_t i = 0; i < target->chunks[n].uncompressedSize; i++)
+		{
+			targetCounts[data[i]]++;
+		}
+	}
+	
+	HuffBuildTree(targetCounts, target->dictionary, HUFF_MAX_CODE_BITS);
+}
+
+void RecompressGraphicsChunk(CgaMode gfxMode, int n, huffcodebook* codebook)
+{
+	GraphChunk* chunk = &targetGraphics[gfxMode].chunks[n];
+	int headerSize = (n == STARTTILE8) ? 0 : 4;
+	int bufferSpace = chunk->uncompressedSize * 4 + 16;
+	uint8_t* newCompressedData = new uint8_t[bufferSpace];
+	
+	if(headerSize)
+	{
+		*(uint32_t*)(newCompressedData) = chunk->uncompressedSize;
+	}
+	
+	chunk->data = newCompressedData;
+	chunk->dataSize = headerSize + HuffCompress(chunk->uncompressedData, chunk->uncompressedSize, newCompressedData + headerSize, bufferSpace - headerSize, codebook);
+}
+
+void WriteGraphics(CgaMode gfxMode)
+{
+	TargetGraphics* target = &targetGraphics[gfxMode];
+	GraphChunk* chunks = target->chunks;
+	int numChunks = sourceGraphics.numChunks;
+
+	printf("Generating %s..\n", isDemo ? gfxFilenameDemo[gfxMode] : gfxFilename[gfxMode]);
+
+	FILE* graphicsFileOut = fopen(isDemo ? gfxFilenameDemo[gfxMode] : gfxFilename[gfxMode], "wb");
+	uint32_t totalGraphicsFileLength = 0;
+	for (int n = 0; n < numChunks; n++)
+	{
+		fwrite(chunks[n].data, 1, chunks[n].dataSize, graphicsFileOut);
+		chunks[n].headerOffset = totalGraphicsFileLength;
+		totalGraphicsFileLength += chunks[n].dataSize;
+	}
+	fclose(graphicsFileOut);
+
+	FILE* dictFileOut = fopen(isDemo ? dictFilenameDemo[gfxMode] : dictFilename[gfxMode], "wb");
+	fwrite(target->dictionary, sizeof(target->dictionary), 1, dictFileOut);
+	fclose(dictFileOut);
+
+	FILE* graphicsHeadOut = fopen(isDemo ? headFilenameDemo[gfxMode] : headFilename[gfxMode], "wb");
+	for (int n = 0; n < numChunks; n++)
+	{
+		uint32_t offset = chunks[n].headerOffset;
+
+		for (int n = 0; n < 3; n++)
+		{
+			uint8_t writeOut = (uint8_t)(offset & 0xff);
+			fwrite(&writeOut, 1, 1, graphicsHeadOut);
+			offset >>= 8;
+		}
+	}
+	{
+		uint32_t offset = totalGraphicsFileLength;
+
+		for (int n = 0; n < 3; n++)
+		{
+			uint8_t writeOut = (uint8_t)(offset & 0xff);
+			fwrite(&writeOut, 1, 1, graphicsHeadOut);
+			offset >>= 8;
+		}
+	}
+	fclose(graphicsHeadOut);
+}
+
+void ProcessGraphics()
+{
+	int numChunks = sourceGraphics.numChunks;
+	
+	for(int mode = 0; mode < NUM_GFX_MODES; mode++)
+	{
+		targetGraphics[mode].chunks = new GraphChunk[numChunks];
+		memcpy(targetGraphics[mode].dictionary, sourceGraphics.dictionary, sizeof(sourceGraphics.dictionary));
+	}
+	
+	RunJobs(NUM_GFX_MODES * numChunks, [&](int job)
+	{
+		ConvertGraphicsChunk((CgaMode)(job / numChunks), job % numChunks);
+	});
+	
+	if(useBuildCache)
+	{
+		printf("Build cache: reused %d of %d converted pics\n", (int) buildCacheHits, NUM_GFX_MODES * NUMPICS);
+		SaveBuildCache();
+	}
+	
+	if(optimiseDictionaries)
+	{
+		uint32_t vgaDictionarySize[NUM_GFX_MODES];
+		huffcodebook targetCodebook[NUM_GFX_MODES];
+		
+		for(int mode = 0; mode < NUM_GFX_MODES; mode++)
+		{
+			vgaDictionarySize[mode] = 0;
+			for(int n = 0; n < numChunks; n++)
+			{
+				vgaDictionarySize[mode] += targetGraphics[mode].chunks[n].dataSize;
+			}
+			
+			BuildTargetDictionary((CgaMode) mode);
+			HuffBuildCodebook(targetGraphics[mode].dictionary, &targetCodebook[mode]);
+		}
+		
+		RunJobs(NUM_GFX_MODES * numChunks, [&](int job)
+		{
+			int mode = job / numChunks;
+			RecompressGraphicsChunk((CgaMode) mode, job % numChunks, &targetCodebook[mode]);
+		});
+		
+		for(int mode = 0; mode < NUM_GFX_MODES; mode++)
+		{
+			uint32_t targetDictionarySize = 0;
+			for(int n = 0; n < numChunks; n++)
+			{
+				targetDictionarySize += targetGraphics[mode].chunks[n].dataSize;
+			}
+			printf("%s: %d bytes with VGA dictionary, %d bytes with own dictionary\n", isDemo ? gfxFilenameDemo[mode] : gfxFilename[mode], vgaDictionarySize[mode], targetDictionarySize);
+		}
+	}
+	
+	for(int mode = 0; mode < NUM_GFX_MODES; mode++)
+	{
+		WriteGraphics((CgaMode) mode);
+	}
+}
+
+//
+// The signon screen for each of the RGB, composite, Tandy and LCD modes, in
+// the order the engine looks them up
+//
+#define NUM_SIGNONS 4
+#define SIGNON_WIDTH 320
+#define SIGNON_HEIGHT 200
+#define SIGNON_SIZE (SIGNON_WIDTH * SIGNON_HEIGHT / 4)
+
+void GenerateSignon()
+{
+	vector<uint8_t> pixels;
+	unsigned width, height;
+
+	printf("Generating signon..\n");
+	
+	if(lodepng::decode(pixels, width, height, "signon.png"))
+	{
+		printf("Could not load signon.png - skipping\n");
+		return;
 	}
 	
 	vector<uint8_t> output;
@@ -1072,20 +2417,151 @@ void GenerateSignon()
 	}
 	
 	
-	FILE* fs = fopen("signon.c", "w");
+	// SIGNON.ext starts with the offset (long) of each mode's screen and then
+	// their lengths (unsigned), and DrawSignon in WL_MAIN.C only reads and
+	// expands the one it needs
+	if(output.size() != NUM_SIGNONS * SIGNON_SIZE)
+	{
+		printf("signon.png must be %dx%d\n", SIGNON_WIDTH, SIGNON_HEIGHT);
+		exit(1);
+	}
+	
+	const char* filename = isDemo ? "SIGNON.WL1" : "SIGNON.WL6";
+	vector<uint8_t> compressed[NUM_SIGNONS];
+	uint32_t offsets[NUM_SIGNONS];
+	uint16_t lengths[NUM_SIGNONS];
+	uint32_t pos = sizeof(offsets) + sizeof(lengths);
+	
+	RunJobs(NUM_SIGNONS, [&](int n)
+	{
+		CarmackCompress((const uint16_t*)(output.data() + n * SIGNON_SIZE), SIGNON_SIZE / 2, &compressed[n]);
+	});
+	
+	for(int n = 0; n < NUM_SIGNONS; n++)
+	{
+		offsets[n] = pos;
+		lengths[n] = (uint16_t) compressed[n].size();
+		pos += lengths[n];
+	}
+	
+	FILE* fs = fopen(filename, "wb");
+	if(!fs)
+	{
+		printf("Could not open %s for writing\n", filename);
+		exit(1);
+	}
+	fwrite(offsets, 1, sizeof(offsets), fs);
+	fwrite(lengths, 1, sizeof(lengths), fs);
+	for(int n = 0; n < NUM_SIGNONS; n++)
+	{
+		fwrite(compressed[n].data(), 1, compressed[n].size(), fs);
+	}
+	fclose(fs);
+}
+
+//
+// Bench mode.  "bench" times every stage of the conversion, plus a Huffman
+// round trip over the VGA graphics, and checks the hash of every output
+// against CGAGOLD.WL1/WL6.  "golden" writes those hashes instead.  Entries
+// are named after the file plus any options that change its bytes, so one
+// golden file covers plain, optimise and layout runs side by side, and
+// outputs an option doesn't touch are still checked against the plain entry
+//
+
+// optimise only changes the graphics files
+string GetGraphicsBenchOptions()
+{
+	return optimiseDictionaries ? " optimise" : "";
+}
+
+// layout only changes the SWAP files
+string GetSwapBenchOptions()
+{
+	return optimiseLayout ? " layout" : "";
+}
+
+uint32_t GetSourceGraphicsSize()
+{
+	uint32_t total = 0;
+	
+	for(int n = 0; n < sourceGraphics.numChunks; n++)
+	{
+		total += sourceGraphics.chunks[n].uncompressedSize;
+	}
+	return total;
+}
+
+void BenchHuffman()
+{
+	int numChunks = sourceGraphics.numChunks;
+	vector<vector<uint8_t> > compressed(numChunks);
+	int mismatches = 0;
+	
+	BenchRun("HuffCompress", [&]()
+	{
+		for(int n = 0; n < numChunks; n++)
+		{
+			GraphChunk* chunk = &sourceGraphics.chunks[n];
+			
+			if(chunk->uncompressedData)
+			{
+				compressed[n].resize(chunk->uncompressedSize * 4 + 16);
+				int32_t length = HuffCompress(chunk->uncompressedData, chunk->uncompressedSize, compressed[n].data(), (int32_t) compressed[n].size(), &sourceGraphics.codebook);
+				compressed[n].resize(length);
+			}
+		}
+		return (double) GetSourceGraphicsSize();
+	});
+	
+	huffdecodetable* decodetable = new huffdecodetable;
+	HuffBuildDecodeTable(sourceGraphics.dictionary, decodetable);
 	
-	fprintf(fs, "unsigned char far signon[] = {\n");
-	for(int n = 0; n < output.size(); n++)
+	BenchRun("HuffExpand", [&]()
 	{
-		fprintf(fs, "0x%x", output[n]);
-		if(n < output.size() - 1)
+		for(int n = 0; n < numChunks; n++)
 		{
-			fprintf(fs, ",");
+			GraphChunk* chunk = &sourceGraphics.chunks[n];
+			
+			if(chunk->uncompressedData)
+			{
+				vector<uint8_t> expanded(chunk->uncompressedSize);
+				HuffExpand(compressed[n].data(), (int32_t) compressed[n].size(), expanded.data(), chunk->uncompressedSize, decodetable);
+				if(memcmp(expanded.data(), chunk->uncompressedData, chunk->uncompressedSize))
+				{
+					mismatches++;
+				}
+			}
 		}
+		return (double) GetSourceGraphicsSize();
+	});
+	
+	delete decodetable;
+	
+	if(mismatches)
+	{
+		printf("Huffman round trip failed for %d chunks!\n", mismatches);
+	}
+}
+
+int CheckBenchmarkOutputs()
+{
+	string options = GetGraphicsBenchOptions();
+	
+	for(int mode = 0; mode < NUM_GFX_MODES; mode++)
+	{
+		BenchAddFileHash(isDemo ? headFilenameDemo[mode] : headFilename[mode], options.c_str());
+		BenchAddFileHash(isDemo ? gfxFilenameDemo[mode] : gfxFilename[mode], options.c_str());
+		BenchAddFileHash(isDemo ? dictFilenameDemo[mode] : dictFilename[mode], options.c_str());
+	}
+	BenchAddFileHash(isDemo ? "SIGNON.WL1" : "SIGNON.WL6");
+	if(expandMaps)
+	{
+		BenchAddFileHash(isDemo ? "FASTHEAD.WL1" : "FASTHEAD.WL6");
+		BenchAddFileHash(isDemo ? "FASTMAPS.WL1" : "FASTMAPS.WL6");
 	}
-	fprintf(fs, "};\n");
 	
-	fclose(fs);
+	BenchReport();
+	return BenchCheckGolden(isDemo ? "CGAGOLD.WL1" : "CGAGOLD.WL6", updateGolden) ? 1 : 0;
 }
 
 int main(int argc, char** argv)
@@ -1095,6 +2571,7 @@ int main(int argc, char** argv)
 	GenerateCGAPaletteRGB();
 
 	GenerateLUT();
+	GeneratePicLUTs();
 	
 	for(int n = 1; n < argc; n++)
 	{
@@ -1102,44 +2579,153 @@ int main(int argc, char** argv)
 		{
 			isDemo = true;
 		}
+		if(!stricmp(argv[n], "verify"))
+		{
+			verifyRecompress = true;
+		}
+		if(!stricmp(argv[n], "optimise"))
+		{
+			optimiseDictionaries = true;
+		}
+		if(!stricmp(argv[n], "cache"))
+		{
+			useBuildCache = true;
+		}
+		if(!stricmp(argv[n], "layout"))
+		{
+			optimiseLayout = true;
+		}
+		if(!stricmp(argv[n], "expandmaps"))
+		{
+			expandMaps = true;
+		}
+		if(!stricmp(argv[n], "bench"))
+		{
+			runBenchmark = true;
+		}
+		if(!stricmp(argv[n], "golden"))
+		{
+			runBenchmark = true;
+			updateGolden = true;
+		}
+		if(!stricmp(argv[n], "threads") && n + 1 < argc)
+		{
+			numThreads = atoi(argv[++n]);
+		}
 	}
 
-	for(int n = 0; n < NUM_GFX_MODES; n++)
+	if(useBuildCache)
 	{
-		ProcessGraphics((CgaMode) n);
+		LoadBuildCache();
 	}
+	BenchRun("Load VGA graphics", [&]()
+	{
+		LoadSourceGraphics();
+		return (double) sourceGraphics.graphicsFile.size;
+	});
+	BenchRun("Convert graphics", [&]()
+	{
+		ProcessGraphics();
+		return (double) GetSourceGraphicsSize() * NUM_GFX_MODES;
+	});
+	
+	if(runBenchmark)
+	{
+		BenchHuffman();
+	}
+	
+	BenchRun("Signon", [&]()
+	{
+		GenerateSignon();
+		return 0.0;
+	});
 	
-	GenerateSignon();
+	if(expandMaps)
+	{
+		BenchRun("Expand maps", [&]()
+		{
+			GenerateExpandedMaps();
+			return 0.0;
+		});
+	}
 	
 	//if(argc == 2)
 	{
 		//FILE* fs = fopen(argv[1], "rb");
 		//FILE* fo = fopen("CSWAP.WL6", "wb");
 		//FILE* fx = fopen("XSWAP.WL6", "wb");
-		FILE* fs;
-
-		fs = fopen(isDemo ? "VSWAP.WL1" : "VSWAP.WL6", "rb");
+		MappedFile swapFile;
 		
-		if(!fs)
+		if(!MapFile(isDemo ? "VSWAP.WL1" : "VSWAP.WL6", &swapFile))
 		{
 			printf(isDemo ? "Could not open VSWAP.WL1\n" : "Could not open VSWAP.WL6\n");
 			exit(1);
 		}
 		
-		if(fs)
 		{
-			fseek(fs, 0, SEEK_END);
-			long dataSize = ftell(fs);
-			uint8_t* data = new uint8_t[dataSize];
-			fseek(fs, 0, SEEK_SET);
-			fread(data, 1, dataSize, fs);
+			const uint8_t* data = swapFile.data;
+			long dataSize = swapFile.size;
 			
-			GenerateDataFile(isDemo ? "XSWAP.WL1" : "XSWAP.WL6", data, dataSize, convertLUTComposite);
-			GenerateDataFile(isDemo ? "CSWAP.WL1" : "CSWAP.WL6", data, dataSize, convertLUT);
-			GenerateDataFile(isDemo ? "TSWAP.WL1" : "TSWAP.WL6", data, dataSize, convertLUTTandy);
-			GenerateDataFile(isDemo ? "LSWAP.WL1" : "LSWAP.WL6", data, dataSize, convertLUTLCD);
+			if(optimiseLayout)
+			{
+				BenchRun("Chunk layout", [&]()
+				{
+					BuildChunkLayout(data);
+					return 0.0;
+				});
+			}
 			
-			fclose(fs);
+			const char* swapFilename[] =
+			{
+				isDemo ? "XSWAP.WL1" : "XSWAP.WL6",
+				isDemo ? "CSWAP.WL1" : "CSWAP.WL6",
+				isDemo ? "TSWAP.WL1" : "TSWAP.WL6",
+				isDemo ? "LSWAP.WL1" : "LSWAP.WL6"
+			};
+			uint8_t* swapConversionTable[] =
+			{
+				convertLUTComposite,
+				convertLUT,
+				convertLUTTandy,
+				convertLUTLCD
+			};
+			
+			const char* planarSwapFilename = isDemo ? "ESWAP.WL1" : "ESWAP.WL6";
+			
+			for(int n = 0; n < 4; n++)
+			{
+				printf("Generating %s..\n", swapFilename[n]);
+			}
+			printf("Generating %s..\n", planarSwapFilename);
+			
+			BenchRun("Generate SWAP files", [&]()
+			{
+				RunJobs(5, [&](int n)
+				{
+					if(n < 4)
+					{
+						GenerateDataFile(swapFilename[n], data, dataSize, swapConversionTable[n]);
+					}
+					else
+					{
+						GeneratePlanarDataFile(planarSwapFilename, data, dataSize);
+					}
+				});
+				return (double) dataSize * 5;
+			});
+			
+			UnmapFile(&swapFile);
+			
+			if(runBenchmark)
+			{
+				string options = GetSwapBenchOptions();
+				
+				for(int n = 0; n < 4; n++)
+				{
+					BenchAddFileHash(swapFilename[n], options.c_str());
+				}
+				BenchAddFileHash(planarSwapFilename, options.c_str());
+			}
 			
 			/*int index = 0;
 			uint8_t data;
@@ -1167,6 +2753,10 @@ int main(int argc, char** argv)
 		}
 		
 	}
+	if(runBenchmark)
+	{
+		return CheckBenchmarkOutputs();
+	}
 	return 0;
 }
 
@@ -16,9 +16,9 @@
  * pixel.  The resulting planes are then compressed with the provided
  * HuffCompress routine and written into EGAGRAPH and EGAHEAD files.
  *
- * Note that this tool is intentionally kept simple – it does not attempt
- * sophisticated dithering.  Feel free to extend it with error diffusion or
- * ordered dithering if you prefer a different trade‑off between colour
+ * Plain nearest-colour mapping is the default.  Floyd–Steinberg and
+ * Atkinson error diffusion and 4×4 / 8×8 Bayer ordered dithering can be
+ * selected on the command line for a different trade‑off between colour
  * accuracy and noise.
  */
 
@@ -28,7 +28,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <string>
 #include "huffman.cpp"
+#include "jobs.cpp"
+#include "bench.cpp"
 
 using namespace std;
 
@@ -84,34 +87,360 @@ static uint8_t map_to_ega(uint8_t r, uint8_t g, uint8_t b)
     return idx;
 }
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EGAIFY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if EGAIFY_SSE2
+
+// Each palette entry as red/green and blue/zero pairs of 16-bit values,
+// repeated for four pixels, so _mm_madd_epi16 on a difference gives
+// dr*dr + dg*dg and db*db for four pixels at once.
+static __m128i ega_palette_rg[16];
+static __m128i ega_palette_b[16];
+static bool ega_palette_ready = false;
+
+static void init_ega_palette_sse2()
+{
+    for (int i = 0; i < 16; i++)
+    {
+        const uint8_t *p = ega_palette[i];
+        ega_palette_rg[i] = _mm_setr_epi16(p[0], p[1], p[0], p[1], p[0], p[1], p[0], p[1]);
+        ega_palette_b[i] = _mm_setr_epi16(p[2], 0, p[2], 0, p[2], 0, p[2], 0);
+    }
+    ega_palette_ready = true;
+}
+
+// Nearest EGA entries for four RGBA pixels.  Each distance is below 2^18, so
+// (distance << 4) | index is exact as a float and the minimum of those picks
+// the lowest index on a tie, the same as map_to_ega.
+static inline void map4_to_ega_sse2(const uint8_t *rgba, uint8_t *indices)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i pixels = _mm_loadu_si128((const __m128i *)rgba);
+    const __m128i lo = _mm_unpacklo_epi8(pixels, zero);  // r0 g0 b0 a0 r1 g1 b1 a1
+    const __m128i hi = _mm_unpackhi_epi8(pixels, zero);  // r2 g2 b2 a2 r3 g3 b3 a3
+    // Gather r,g pairs and b,0 pairs for the four pixels
+    const __m128i lo32 = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));  // rg0 rg1 ba0 ba1
+    const __m128i hi32 = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));  // rg2 rg3 ba2 ba3
+    const __m128i pixel_rg = _mm_unpacklo_epi64(lo32, hi32);
+    const __m128i pixel_b = _mm_and_si128(_mm_unpackhi_epi64(lo32, hi32), _mm_set1_epi32(0xffff));
+    __m128 best = _mm_set1_ps(1e30f);
+
+    for (int i = 0; i < 16; i++)
+    {
+        __m128i drg = _mm_sub_epi16(pixel_rg, ega_palette_rg[i]);
+        __m128i db = _mm_sub_epi16(pixel_b, ega_palette_b[i]);
+        __m128i dist = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db, db));
+        __m128i key = _mm_or_si128(_mm_slli_epi32(dist, 4), _mm_set1_epi32(i));
+        best = _mm_min_ps(best, _mm_cvtepi32_ps(key));
+    }
+
+    __m128i result = _mm_and_si128(_mm_cvtps_epi32(best), _mm_set1_epi32(0x0F));
+    result = _mm_packs_epi32(result, result);
+    result = _mm_packus_epi16(result, result);
+    uint32_t packed = (uint32_t)_mm_cvtsi128_si32(result);
+    memcpy(indices, &packed, 4);
+}
+
+#endif
+
+// Map a whole RGBA image to EGA indices, four pixels at a time where SSE2 is
+// available.
+static void map_image_to_ega(const uint8_t *rgba, uint8_t *indices, size_t count)
+{
+    size_t i = 0;
+#if EGAIFY_SSE2
+    if (!ega_palette_ready)
+    {
+        init_ega_palette_sse2();
+    }
+    for (; i + 4 <= count; i += 4)
+    {
+        map4_to_ega_sse2(rgba + i * 4, indices + i);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        indices[i] = map_to_ega(rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2]);
+    }
+}
+
+// Dithering.  The ordered modes look every pixel up in a table built per
+// threshold level, indexed by the colour reduced to 5 bits per channel.  The
+// diffusion modes stream through the image a row at a time, carrying the
+// error forward in a small ring of integer line buffers: two rows for
+// Floyd-Steinberg and three for Atkinson, which reaches two rows down.
+enum dither_mode
+{
+    DITHER_NONE,
+    DITHER_FLOYD_STEINBERG,
+    DITHER_ATKINSON,
+    DITHER_BAYER4,
+    DITHER_BAYER8
+};
+
+static const struct
+{
+    const char *name;
+    dither_mode mode;
+} dither_names[] = {
+    {"none", DITHER_NONE},
+    {"floyd", DITHER_FLOYD_STEINBERG},
+    {"atkinson", DITHER_ATKINSON},
+    {"bayer4", DITHER_BAYER4},
+    {"bayer8", DITHER_BAYER8}
+};
+
+// Distance between neighbouring EGA intensity levels, which is how far the
+// ordered dither thresholds spread a colour.
+#define EGA_LEVEL_SPREAD 0x55
+
+#define RGB555_INDEX(r, g, b) ((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3))
+
+static inline uint8_t clamp_channel(int value)
+{
+    return (uint8_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+// Fill a 32K table with the nearest EGA index for the centre of every 5 bit
+// per channel colour, shifted by bias on each channel.
+static void build_rgb555_lut(int bias, uint8_t *lut)
+{
+    vector<uint8_t> rgba(32768 * 4);
+    for (int i = 0; i < 32768; i++)
+    {
+        rgba[i * 4 + 0] = clamp_channel((((i >> 10) & 31) << 3) + 4 + bias);
+        rgba[i * 4 + 1] = clamp_channel((((i >> 5) & 31) << 3) + 4 + bias);
+        rgba[i * 4 + 2] = clamp_channel(((i & 31) << 3) + 4 + bias);
+        rgba[i * 4 + 3] = 255;
+    }
+    map_image_to_ega(&rgba[0], lut, 32768);
+}
+
+// Tables shared by every image, built once up front by prepare_dither so
+// that images can be dithered concurrently.
+static vector<uint8_t> nearest_lut;
+static unsigned bayer_matrix[2][8 * 8];
+static vector<uint8_t> bayer_luts[2];
+
+static void prepare_bayer(int table, unsigned matrix_size)
+{
+    if (!bayer_luts[table].empty())
+    {
+        return;
+    }
+
+    // Bayer matrix by recursive doubling: M(2n) = [4M, 4M+2; 4M+3, 4M+1]
+    unsigned *matrix = bayer_matrix[table];
+    matrix[0] = 0;
+    for (unsigned size = 1; size < matrix_size; size *= 2)
+    {
+        for (unsigned y = size; y-- > 0;)
+        {
+            for (unsigned x = size; x-- > 0;)
+            {
+                unsigned m = matrix[y * size + x] * 4;
+                matrix[y * size * 2 + x] = m;
+                matrix[y * size * 2 + x + size] = m + 2;
+                matrix[(y + size) * size * 2 + x] = m + 3;
+                matrix[(y + size) * size * 2 + x + size] = m + 1;
+            }
+        }
+    }
+
+    unsigned levels = matrix_size * matrix_size;
+    bayer_luts[table].resize(levels * 32768);
+    for (unsigned t = 0; t < levels; t++)
+    {
+        int bias = (int)(((t + 0.5) / levels - 0.5) * EGA_LEVEL_SPREAD);
+        build_rgb555_lut(bias, &bayer_luts[table][t * 32768]);
+    }
+}
+
+static void prepare_dither(dither_mode mode)
+{
+#if EGAIFY_SSE2
+    if (!ega_palette_ready)
+    {
+        init_ega_palette_sse2();
+    }
+#endif
+    switch (mode)
+    {
+    case DITHER_FLOYD_STEINBERG:
+    case DITHER_ATKINSON:
+        if (nearest_lut.empty())
+        {
+            nearest_lut.resize(32768);
+            build_rgb555_lut(0, &nearest_lut[0]);
+        }
+        break;
+    case DITHER_BAYER4:
+        prepare_bayer(0, 4);
+        break;
+    case DITHER_BAYER8:
+        prepare_bayer(1, 8);
+        break;
+    default:
+        break;
+    }
+}
+
+static void dither_ordered(const uint8_t *rgba, uint8_t *indices, unsigned width, unsigned height, int table, unsigned matrix_size)
+{
+    const unsigned *matrix = bayer_matrix[table];
+    const uint8_t *luts = &bayer_luts[table][0];
+
+    for (unsigned y = 0; y < height; y++)
+    {
+        const unsigned *row_thresholds = &matrix[(y % matrix_size) * matrix_size];
+        for (unsigned x = 0; x < width; x++)
+        {
+            const uint8_t *p = rgba + 4 * ((size_t)y * width + x);
+            const uint8_t *lut = &luts[row_thresholds[x % matrix_size] * 32768];
+            indices[(size_t)y * width + x] = lut[RGB555_INDEX(p[0], p[1], p[2])];
+        }
+    }
+}
+
+static void dither_diffuse(const uint8_t *rgba, uint8_t *indices, unsigned width, unsigned height, dither_mode mode)
+{
+    struct diffusion
+    {
+        int dx, dy, weight;
+    };
+    static const diffusion floyd_steinberg[] = {
+        {1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}
+    };
+    static const diffusion atkinson[] = {
+        {1, 0, 2}, {2, 0, 2}, {-1, 1, 2}, {0, 1, 2}, {1, 1, 2}, {0, 2, 2}
+    };
+    // Weights are in sixteenths.  Atkinson only passes on six eighths
+    const diffusion *kernel = mode == DITHER_ATKINSON ? atkinson : floyd_steinberg;
+    int kernel_size = mode == DITHER_ATKINSON ? 6 : 4;
+    unsigned rows = mode == DITHER_ATKINSON ? 3 : 2;
+
+    const uint8_t *lut = &nearest_lut[0];
+
+    // Error rows in sixteenths, padded by two pixels either side
+    const unsigned stride = (width + 4) * 3;
+    vector<int> error(rows * stride);
+
+    for (unsigned y = 0; y < height; y++)
+    {
+        int *current = &error[(y % rows) * stride];
+        for (unsigned x = 0; x < width; x++)
+        {
+            const uint8_t *p = rgba + 4 * ((size_t)y * width + x);
+            int *e = current + (x + 2) * 3;
+            uint8_t wanted[3];
+            for (int c = 0; c < 3; c++)
+            {
+                wanted[c] = clamp_channel(p[c] + e[c] / 16);
+            }
+
+            uint8_t index = lut[RGB555_INDEX(wanted[0], wanted[1], wanted[2])];
+            indices[(size_t)y * width + x] = index;
+
+            for (int c = 0; c < 3; c++)
+            {
+                int diff = wanted[c] - ega_palette[index][c];
+                for (int k = 0; k < kernel_size; k++)
+                {
+                    if (y + kernel[k].dy >= height)
+                    {
+                        continue;
+                    }
+                    int *target = &error[((y + kernel[k].dy) % rows) * stride];
+                    target[(x + 2 + kernel[k].dx) * 3 + c] += diff * kernel[k].weight;
+                }
+            }
+        }
+        // This row is finished with, so it becomes the furthest row ahead
+        memset(current, 0, stride * sizeof(int));
+    }
+}
+
+// prepare_dither must have been called for the mode first.
+static void dither_image_to_ega(const uint8_t *rgba, uint8_t *indices, unsigned width, unsigned height, dither_mode mode)
+{
+    switch (mode)
+    {
+    case DITHER_FLOYD_STEINBERG:
+    case DITHER_ATKINSON:
+        dither_diffuse(rgba, indices, width, height, mode);
+        break;
+    case DITHER_BAYER4:
+        dither_ordered(rgba, indices, width, height, 0, 4);
+        break;
+    case DITHER_BAYER8:
+        dither_ordered(rgba, indices, width, height, 1, 8);
+        break;
+    default:
+        map_image_to_ega(rgba, indices, (size_t)width * height);
+        break;
+    }
+}
+
+// Planar output layouts.  PLANAR_PLANES stores each plane whole, one after
+// another.  PLANAR_ROWS interleaves them a row at a time (plane 0 row 0,
+// plane 1 row 0, ... plane 3 row 0, plane 0 row 1, ...) so a whole row can
+// be blitted in one sweep of the map mask.
+enum planar_layout
+{
+    PLANAR_PLANES,
+    PLANAR_ROWS
+};
+
+// Transpose 8 palette indices into one byte per plane, first pixel in the
+// most significant bit.  Masking out one plane leaves a single bit in each
+// byte of the 64-bit word, and the multiply gathers those eight bits into the
+// top byte.
+static inline void pack8_to_planes(const uint8_t *indices, uint8_t *plane_bytes)
+{
+    uint64_t pixels = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        pixels = (pixels << 8) | indices[i];
+    }
+    for (int plane = 0; plane < 4; plane++)
+    {
+        uint64_t bits = (pixels >> plane) & 0x0101010101010101ULL;
+        plane_bytes[plane] = (uint8_t)((bits * 0x8040201008040201ULL) >> 56);
+    }
+}
+
 // Pack planar data.  Given a vector of palette indices of length width*height,
-// produce four separate planes.  Each plane is stored sequentially; each
-// destination byte contains eight pixels (one bit per pixel).  The caller
-// must free the returned buffer.
-static uint8_t *convert_to_planar(const vector<uint8_t> &indices, unsigned width, unsigned height)
+// produce four planes in the given layout.  Each destination byte contains
+// eight pixels (one bit per pixel) and every plane is written sequentially.
+// The caller must free the returned buffer.
+static uint8_t *convert_to_planar(const vector<uint8_t> &indices, unsigned width, unsigned height, planar_layout layout)
 {
     const size_t plane_size = (width * height) / 8; // bytes per plane
+    const size_t row_bytes = width / 8;
     uint8_t *out = (uint8_t *)malloc(plane_size * 4);
     if (!out)
     {
         fprintf(stderr, "Failed to allocate planar buffer\n");
         exit(1);
     }
-    memset(out, 0, plane_size * 4);
+    // Distance between planes, and between rows of the same plane
+    const size_t plane_step = layout == PLANAR_ROWS ? row_bytes : plane_size;
+    const size_t row_step = layout == PLANAR_ROWS ? row_bytes * 4 : row_bytes;
     for (unsigned y = 0; y < height; y++)
     {
-        for (unsigned x = 0; x < width; x++)
+        const uint8_t *src = &indices[(size_t)y * width];
+        uint8_t *dest = out + y * row_step;
+        for (size_t x = 0; x < row_bytes; x++)
         {
-            unsigned pixel_index = indices[y * width + x] & 0x0F;
-            unsigned bit = 7 - (x & 7);
-            unsigned byte_offset = (y * width + x) / 8;
-            for (unsigned plane = 0; plane < 4; plane++)
-            {
-                if ((pixel_index >> plane) & 0x1)
-                {
-                    out[plane * plane_size + byte_offset] |= (1 << bit);
-                }
-            }
+            uint8_t plane_bytes[4];
+            pack8_to_planes(src + x * 8, plane_bytes);
+            dest[x] = plane_bytes[0];
+            dest[plane_step + x] = plane_bytes[1];
+            dest[plane_step * 2 + x] = plane_bytes[2];
+            dest[plane_step * 3 + x] = plane_bytes[3];
         }
     }
     return out;
@@ -124,71 +453,436 @@ static void write_le16(FILE *f, uint16_t v)
     fputc((v >> 8) & 0xFF, f);
 }
 
-// Entry point.  This program expects the following arguments:
-//   egaify <input_png> <output_raw>
-// It will decode the input PNG, map the colours to the EGA palette and
-// output four planar planes concatenated together.  The raw output can
-// then be compressed with HuffCompress and placed into EGAGRAPH.WL6.
-int main(int argc, char **argv)
+// Load a PNG and convert it to EGA planes.  Returns false and fills in error
+// if the file can't be used.
+static bool load_planar_png(const char *path, dither_mode dither, planar_layout layout,
+                            vector<uint8_t> &planar, unsigned &width, unsigned &height, string &error)
 {
-    if (argc < 3)
+    std::vector<unsigned char> png;
+    std::vector<unsigned char> image;
+    char message[512];
+    lodepng::load_file(png, path);
+    if (png.empty())
+    {
+        snprintf(message, sizeof(message), "Error loading file %s", path);
+        error = message;
+        return false;
+    }
+    unsigned decode_error = lodepng::decode(image, width, height, png);
+    if (decode_error)
+    {
+        snprintf(message, sizeof(message), "Error decoding PNG %s: %u", path, decode_error);
+        error = message;
+        return false;
+    }
+    if ((width % 8) != 0)
+    {
+        snprintf(message, sizeof(message), "Width of %s must be a multiple of 8 for planar conversion", path);
+        error = message;
+        return false;
+    }
+    // Map each pixel to EGA index
+    vector<uint8_t> indices(width * height);
+    dither_image_to_ega(&image[0], &indices[0], width, height, dither);
+    // Convert to planar format
+    uint8_t *packed = convert_to_planar(indices, width, height, layout);
+    planar.assign(packed, packed + (width * height) / 2);
+    free(packed);
+    return true;
+}
+
+static bool parse_dither_mode(const char *name, dither_mode &mode)
+{
+    for (size_t i = 0; i < sizeof(dither_names) / sizeof(dither_names[0]); i++)
     {
-        fprintf(stderr, "Usage: %s <input_png> <output_raw>\n", argv[0]);
+        if (!strcmp(name, dither_names[i].name))
+        {
+            mode = dither_names[i].mode;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Batch mode.  The manifest has one chunk per line:
+//   <chunk number> <png path> [dither mode]
+// plus an optional "pictable <first pic chunk>" line, which makes chunk 0 the
+// table of pic sizes for every chunk from there on, the way the engine reads
+// VGAGRAPH, and an optional "tile8 <chunk>" line naming the STARTTILE8 chunk,
+// which the engine expands to a known size and so reads without a length.
+// Blank lines and lines starting with # are skipped.  Chunks not in the
+// manifest are marked sparse ($FFFFFF in the header) the way CAL_ReadGrChunk
+// expects.  Every other chunk is stored the way ProcessGraphics in cgaify
+// writes pics: a 4 byte uncompressed length then Huffman data, with one
+// dictionary built over the whole set.
+struct manifest_entry
+{
+    int chunk;
+    string path;
+    dither_mode dither;
+    vector<uint8_t> data;
+    unsigned width, height;
+    string error;
+};
+
+static void write_offset24(FILE *f, uint32_t offset)
+{
+    fputc(offset & 0xFF, f);
+    fputc((offset >> 8) & 0xFF, f);
+    fputc((offset >> 16) & 0xFF, f);
+}
+
+static int run_manifest(const char *manifest_path, const char *extension, dither_mode default_dither, planar_layout layout)
+{
+    FILE *manifest = fopen(manifest_path, "r");
+    if (!manifest)
+    {
+        fprintf(stderr, "Error opening manifest %s\n", manifest_path);
         return 1;
     }
-    const char *input_path = argv[1];
-    const char *output_path = argv[2];
 
-    // Load PNG
+    vector<manifest_entry> entries;
+    int first_pic = -1;
+    int tile8_chunk = -1;
+    int num_chunks = 1;
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), manifest))
+    {
+        line_number++;
+        char first[512], second[512], third[512];
+        int fields = sscanf(line, "%511s %511s %511s", first, second, third);
+        if (fields <= 0 || first[0] == '#')
+        {
+            continue;
+        }
+        if (!strcmp(first, "pictable") && fields >= 2)
+        {
+            first_pic = atoi(second);
+            continue;
+        }
+        if (!strcmp(first, "tile8") && fields >= 2)
+        {
+            tile8_chunk = atoi(second);
+            if (tile8_chunk <= 0)
+            {
+                fprintf(stderr, "%s:%d: expected tile8 <chunk number>\n", manifest_path, line_number);
+                fclose(manifest);
+                return 1;
+            }
+            continue;
+        }
+        manifest_entry entry;
+        entry.chunk = atoi(first);
+        entry.dither = default_dither;
+        if (fields < 2 || entry.chunk <= 0 || (fields >= 3 && !parse_dither_mode(third, entry.dither)))
+        {
+            fprintf(stderr, "%s:%d: expected <chunk number> <png path> [dither mode]\n", manifest_path, line_number);
+            fclose(manifest);
+            return 1;
+        }
+        entry.path = second;
+        if (entry.chunk + 1 > num_chunks)
+        {
+            num_chunks = entry.chunk + 1;
+        }
+        entries.push_back(entry);
+    }
+    fclose(manifest);
+
+    // Every dither mode used needs its tables before the workers start
+    prepare_dither(DITHER_NONE);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        prepare_dither(entries[i].dither);
+    }
+
+    RunJobs((int)entries.size(), [&](int i)
+    {
+        manifest_entry &entry = entries[i];
+        load_planar_png(entry.path.c_str(), entry.dither, layout, entry.data, entry.width, entry.height, entry.error);
+    });
+
+    vector<vector<uint8_t> > chunks(num_chunks);
+    vector<bool> used(num_chunks, false);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (!entries[i].error.empty())
+        {
+            fprintf(stderr, "%s\n", entries[i].error.c_str());
+            return 1;
+        }
+        if (used[entries[i].chunk])
+        {
+            fprintf(stderr, "Chunk %d is in the manifest more than once\n", entries[i].chunk);
+            return 1;
+        }
+        used[entries[i].chunk] = true;
+        chunks[entries[i].chunk].swap(entries[i].data);
+    }
+
+    if (first_pic > 0)
+    {
+        if (used[0])
+        {
+            fprintf(stderr, "Chunk 0 can't be used with a pictable\n");
+            return 1;
+        }
+        vector<pictabletype> pictable(num_chunks > first_pic ? num_chunks - first_pic : 0);
+        for (size_t i = 0; i < pictable.size(); i++)
+        {
+            pictable[i].width = pictable[i].height = 0;
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].chunk >= first_pic)
+            {
+                pictable[entries[i].chunk - first_pic].width = (int16_t)entries[i].width;
+                pictable[entries[i].chunk - first_pic].height = (int16_t)entries[i].height;
+            }
+        }
+        const uint8_t *table = (const uint8_t *)(pictable.empty() ? NULL : &pictable[0]);
+        chunks[0].assign(table, table + pictable.size() * sizeof(pictabletype));
+        used[0] = true;
+    }
+
+    // One dictionary over the whole set
+    long chunk_counts[256];
+    memset(chunk_counts, 0, sizeof(chunk_counts));
+    for (int n = 0; n < num_chunks; n++)
+    {
+        for (size_t i = 0; i < chunks[n].size(); i++)
+        {
+            chunk_counts[chunks[n][i]]++;
+        }
+    }
+    huffnode dictionary[255];
+    huffcodebook codebook;
+    HuffBuildTree(chunk_counts, dictionary, HUFF_MAX_CODE_BITS);
+    HuffBuildCodebook(dictionary, &codebook);
+
+    vector<vector<uint8_t> > compressed(num_chunks);
+    RunJobs(num_chunks, [&](int n)
+    {
+        if (!used[n])
+        {
+            return;
+        }
+        uint32_t length = (uint32_t)chunks[n].size();
+        int header_size = (n == tile8_chunk) ? 0 : 4;
+        compressed[n].resize(length * 4 + 16);
+        if (header_size)
+        {
+            memcpy(&compressed[n][0], &length, 4);
+        }
+        long size = HuffCompress(length ? &chunks[n][0] : NULL, length, &compressed[n][header_size], (long)compressed[n].size() - header_size, &codebook);
+        compressed[n].resize(size + header_size);
+    });
+
+    string graph_name = string("EGAGRAPH.") + extension;
+    string head_name = string("EGAHEAD.") + extension;
+    string dict_name = string("EGADICT.") + extension;
+    FILE *graph = fopen(graph_name.c_str(), "wb");
+    FILE *head = fopen(head_name.c_str(), "wb");
+    FILE *dict = fopen(dict_name.c_str(), "wb");
+    if (!graph || !head || !dict)
+    {
+        fprintf(stderr, "Error opening output files\n");
+        return 1;
+    }
+    uint32_t offset = 0;
+    for (int n = 0; n < num_chunks; n++)
+    {
+        if (!used[n])
+        {
+            write_offset24(head, 0xFFFFFF);
+            continue;
+        }
+        write_offset24(head, offset);
+        fwrite(&compressed[n][0], 1, compressed[n].size(), graph);
+        offset += (uint32_t)compressed[n].size();
+    }
+    write_offset24(head, offset);
+    fwrite(dictionary, sizeof(dictionary), 1, dict);
+    fclose(graph);
+    fclose(head);
+    fclose(dict);
+
+    printf("Wrote %d chunks (%u bytes) to %s, %s and %s\n", num_chunks, offset, graph_name.c_str(), head_name.c_str(), dict_name.c_str());
+    return 0;
+}
+
+// Bench mode.  Times each conversion stage for one PNG, repeating it
+// BENCH_REPEATS times so small images still give a usable rate, and checks
+// the indices and planes against EGAGOLD.TXT ("golden" rewrites the entries
+// for this image and set of options).  The EGAGOLD.TXT next to this file
+// covers signon.png with every dither and layout.
+#define BENCH_REPEATS 16
+#define BENCH_GOLDEN_FILE "EGAGOLD.TXT"
+
+static int run_benchmark(const char *path, dither_mode dither, planar_layout layout, bool update_golden)
+{
     std::vector<unsigned char> png;
     std::vector<unsigned char> image;
-    unsigned width, height;
-    unsigned error;
-    error = lodepng::load_file(png, input_path);
-    if (error)
+    unsigned width = 0, height = 0;
+    unsigned decode_error = 0;
+    lodepng::load_file(png, path);
+    if (png.empty())
     {
-        fprintf(stderr, "Error loading file %s: %u\n", input_path, error);
+        fprintf(stderr, "Error loading file %s\n", path);
         return 1;
     }
-    error = lodepng::decode(image, width, height, png);
-    if (error)
+    BenchRun("Decode PNG", [&]()
     {
-        fprintf(stderr, "Error decoding PNG %s: %u\n", input_path, error);
+        for (int n = 0; n < BENCH_REPEATS && !decode_error; n++)
+        {
+            image.clear();
+            decode_error = lodepng::decode(image, width, height, png);
+        }
+        return (double)png.size() * BENCH_REPEATS;
+    });
+    if (decode_error || (width % 8) != 0)
+    {
+        fprintf(stderr, "%s must be a PNG with a width that is a multiple of 8\n", path);
         return 1;
     }
-    if ((width % 8) != 0)
+    const size_t count = (size_t)width * height;
+    vector<uint8_t> indices(count);
+    BenchRun("map_to_ega", [&]()
     {
-        fprintf(stderr, "Width must be a multiple of 8 for planar conversion\n");
+        for (int n = 0; n < BENCH_REPEATS; n++)
+        {
+            map_image_to_ega(&image[0], &indices[0], count);
+        }
+        return (double)count * 4 * BENCH_REPEATS;
+    });
+    if (dither != DITHER_NONE)
+    {
+        BenchRun("Dither", [&]()
+        {
+            prepare_dither(dither);
+            for (int n = 0; n < BENCH_REPEATS; n++)
+            {
+                dither_image_to_ega(&image[0], &indices[0], width, height, dither);
+            }
+            return (double)count * 4 * BENCH_REPEATS;
+        });
+    }
+    vector<uint8_t> planar;
+    BenchRun("convert_to_planar", [&]()
+    {
+        for (int n = 0; n < BENCH_REPEATS; n++)
+        {
+            uint8_t *packed = convert_to_planar(indices, width, height, layout);
+            planar.assign(packed, packed + count / 2);
+            free(packed);
+        }
+        return (double)count * BENCH_REPEATS;
+    });
+
+    // The options go in the names so each combination has its own entry
+    const char *dither_name = "none";
+    for (size_t i = 0; i < sizeof(dither_names) / sizeof(dither_names[0]); i++)
+    {
+        if (dither_names[i].mode == dither)
+        {
+            dither_name = dither_names[i].name;
+        }
+    }
+    // Named by the file alone so the golden entries don't depend on where it
+    // was run from
+    const char *base_name = path;
+    for (const char *c = path; *c; c++)
+    {
+        if (*c == '/' || *c == '\\' || *c == ':')
+        {
+            base_name = c + 1;
+        }
+    }
+    // The layout only changes the planar output, so the indices are keyed
+    // by the dither alone
+    string name = string(base_name) + " " + dither_name;
+    BenchAddHash((name + " indices").c_str(), &indices[0], count);
+    BenchAddHash((name + (layout == PLANAR_ROWS ? " rows" : " planes") + " planar").c_str(), &planar[0], planar.size());
+
+    printf("%s: %ux%u, %d passes per stage\n", path, width, height, BENCH_REPEATS);
+    BenchReport();
+    return BenchCheckGolden(BENCH_GOLDEN_FILE, update_golden) ? 1 : 0;
+}
+
+// Entry point.  This program expects the following arguments:
+//   egaify <input_png> <output_raw> [none|floyd|atkinson|bayer4|bayer8] [rows]
+// It will decode the input PNG, map the colours to the EGA palette, with
+// optional dithering, and output four planar planes concatenated together,
+// or interleaved a row at a time with "rows".  The raw output can then be
+// compressed with HuffCompress and placed into EGAGRAPH.WL6, or use
+//   egaify manifest <manifest_file> <extension> [dither mode] [rows] [threads N]
+// to convert a whole set of PNGs straight into EGAGRAPH, EGAHEAD and EGADICT.
+int main(int argc, char **argv)
+{
+    bool batch = argc >= 4 && !strcmp(argv[1], "manifest");
+    bool bench = argc >= 3 && !strcmp(argv[1], "bench");
+    bool update_golden = false;
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <input_png> <output_raw> [none|floyd|atkinson|bayer4|bayer8] [rows]\n", argv[0]);
+        fprintf(stderr, "       %s manifest <manifest_file> <extension> [none|floyd|atkinson|bayer4|bayer8] [rows] [threads N]\n", argv[0]);
+        fprintf(stderr, "       %s bench <input_png> [none|floyd|atkinson|bayer4|bayer8] [rows] [golden]\n", argv[0]);
         return 1;
     }
-    // Map each pixel to EGA index
-    vector<uint8_t> indices(width * height);
-    for (unsigned y = 0; y < height; y++)
+    dither_mode dither = DITHER_NONE;
+    planar_layout layout = PLANAR_PLANES;
+    for (int arg = batch ? 4 : 3; arg < argc; arg++)
     {
-        for (unsigned x = 0; x < width; x++)
+        if (!strcmp(argv[arg], "rows"))
+        {
+            layout = PLANAR_ROWS;
+        }
+        else if (bench && !strcmp(argv[arg], "golden"))
         {
-            unsigned idx = 4 * (y * width + x);
-            uint8_t r = image[idx + 0];
-            uint8_t g = image[idx + 1];
-            uint8_t b = image[idx + 2];
-            indices[y * width + x] = map_to_ega(r, g, b);
+            update_golden = true;
+        }
+        else if (batch && !strcmp(argv[arg], "threads") && arg + 1 < argc)
+        {
+            numThreads = atoi(argv[++arg]);
+        }
+        else if (!parse_dither_mode(argv[arg], dither))
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[arg]);
+            return 1;
         }
     }
-    // Convert to planar format
-    uint8_t *planar = convert_to_planar(indices, width, height);
-    const size_t plane_size = (width * height) / 8;
-    size_t total_size = plane_size * 4;
+
+    if (batch)
+    {
+        return run_manifest(argv[2], argv[3], dither, layout);
+    }
+    if (bench)
+    {
+        return run_benchmark(argv[2], dither, layout, update_golden);
+    }
+
+    const char *input_path = argv[1];
+    const char *output_path = argv[2];
+    vector<uint8_t> planar;
+    unsigned width, height;
+    string error;
+    prepare_dither(dither);
+    if (!load_planar_png(input_path, dither, layout, planar, width, height, error))
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    size_t total_size = planar.size();
     // Write raw planar data
     FILE *outf = fopen(output_path, "wb");
     if (!outf)
     {
         fprintf(stderr, "Error opening output file %s\n", output_path);
-        free(planar);
         return 1;
     }
-    fwrite(planar, 1, total_size, outf);
+    fwrite(&planar[0], 1, total_size, outf);
     fclose(outf);
-    free(planar);
     printf("Wrote %zu bytes of planar EGA data to %s (width=%u height=%u)\n", total_size, output_path, width, height);
     return 0;
 }
@@ -20,7 +20,7 @@ long counts[256];
 
 huffnode nodearray[256];	// 256 nodes is worst case
 
-void HuffExpand(byte *source, byte *dest, int32_t length, huffnode *hufftable);
+void HuffExpand(byte *source, int32_t sourceLength, byte *dest, int32_t length, huffnode *hufftable);
 
 void CountBytes (unsigned char *start, long length)
 {
@@ -46,7 +46,123 @@ int HuffFind(int value, huffnode* hufftable)
 	return -1;
 }
 
+//
+// Per symbol bit strings for a huffnode table, first bit to send in bit 0
+//
+typedef struct
+{
+	uint32_t string[256];
+	uint8_t bits[256];		// 0 if the symbol has no code (or one over 32 bits)
+} huffcodebook;
+
+void HuffBuildCodebook(huffnode* hufftable, huffcodebook* codebook)
+{
+	struct
+	{
+		int node;
+		int numBits;
+		uint32_t string;
+	} stack[256];
+	int stackSize = 0;
+	
+	memset(codebook, 0, sizeof(huffcodebook));
+	
+	stack[stackSize].node = 254;		// head node is always node 254
+	stack[stackSize].numBits = 0;
+	stack[stackSize].string = 0;
+	stackSize++;
+	
+	while(stackSize)
+	{
+		stackSize--;
+		int node = stack[stackSize].node;
+		int numBits = stack[stackSize].numBits + 1;
+		uint32_t string = stack[stackSize].string;
+		
+		if(numBits > 32)
+		{
+			// Only unused bytes end up this deep (see TraceNode), leave them out
+			continue;
+		}
+		
+		for(int bit = 0; bit < 2; bit++)
+		{
+			int value = bit ? hufftable[node].bit1 : hufftable[node].bit0;
+			uint32_t childString = bit ? string | (1ul << (numBits - 1)) : string;
+			
+			if(value < 256)
+			{
+				codebook->string[value] = childString;
+				codebook->bits[value] = (uint8_t) numBits;
+			}
+			else
+			{
+				if(value - 256 >= 255 || stackSize >= 256)
+				{
+					printf("Bad huffman table\n");
+					exit(1);
+				}
+				stack[stackSize].node = value - 256;
+				stack[stackSize].numBits = numBits;
+				stack[stackSize].string = childString;
+				stackSize++;
+			}
+		}
+	}
+}
+
+int32_t HuffCompress(uint8_t* source, int32_t length, uint8_t* dest, int32_t destLength, huffcodebook* codebook)
+{
+	uint64_t accumulator = 0;
+	int accumulatorBits = 0;
+	int32_t outputLength = 0;
+	
+	for(int n = 0; n < length; n++)
+	{
+		uint8_t byteToCompress = source[n];
+		int numBits = codebook->bits[byteToCompress];
+		
+		if(!numBits)
+		{
+			printf("Byte %x has no huffman code\n", byteToCompress);
+			exit(1);
+		}
+		
+		accumulator |= (uint64_t) codebook->string[byteToCompress] << accumulatorBits;
+		accumulatorBits += numBits;
+		
+		while(accumulatorBits >= 8)
+		{
+			dest[outputLength++] = (uint8_t) accumulator;
+			accumulator >>= 8;
+			accumulatorBits -= 8;
+			if (outputLength >= destLength)
+			{
+				printf("Out of buffer space!\n");
+				exit(1);
+			}
+		}
+	}
+	
+	if(accumulatorBits)
+	{
+		dest[outputLength++] = (uint8_t) accumulator;
+	}
+	return outputLength;
+}
+
 int32_t HuffCompress(uint8_t* source, int32_t length, uint8_t* dest, int32_t destLength, huffnode* hufftable)
+{
+	huffcodebook codebook;
+	HuffBuildCodebook(hufftable, &codebook);
+	return HuffCompress(source, length, dest, destLength, &codebook);
+}
+
+//
+// Reference encoder: climbs the tree from each leaf with HuffFind.  Slow, but
+// kept so TestRecompress can check the codebook encoder against it
+//
+int32_t HuffCompressTreeWalk(uint8_t* source, int32_t length, uint8_t* dest, int32_t destLength, huffnode* hufftable)
 {
 	uint8_t outputWrite = 0;
 	uint8_t outputMask = 1;
@@ -107,11 +223,23 @@ int32_t HuffCompress(uint8_t* source, int32_t length, uint8_t* dest, int32_t des
 
 bool TestRecompress(uint8_t* uncompressed, int32_t length, uint8_t* refCompressed, int32_t refCompressedLength, huffnode* table)
 {
-	uint8_t* buffer = new uint8_t[length];
-	int32_t compressedLength = HuffCompress(uncompressed, length, buffer, length, table);
+	int32_t bufferLength = length * 4 + 16;
+	uint8_t* buffer = new uint8_t[bufferLength];
+	uint8_t* treeWalkBuffer = new uint8_t[bufferLength];
+	int32_t compressedLength = HuffCompress(uncompressed, length, buffer, bufferLength, table);
+	int32_t treeWalkLength = HuffCompressTreeWalk(uncompressed, length, treeWalkBuffer, bufferLength, table);
 	
 	printf("Reference size: %d bytes Recompressed: %d bytes\n", refCompressedLength, compressedLength);
 	
+	if(compressedLength != treeWalkLength || memcmp(buffer, treeWalkBuffer, compressedLength))
+	{
+		printf("Codebook encoder doesn't match tree walk encoder!\n");
+		delete[] buffer;
+		delete[] treeWalkBuffer;
+		return false;
+	}
+	delete[] treeWalkBuffer;
+	
 	//if(compressedLength == refCompressedLength)
 	{
 		bool isMatching = true;
@@ -121,6 +249,7 @@ bool TestRecompress(uint8_t* uncompressed, int32_t length, uint8_t* refCompresse
 			{
 				printf("Byte at index %d differs\n", n);
 				isMatching = false;
+				delete[] buffer;
 				return false;
 			}
 		}
@@ -128,25 +257,32 @@ bool TestRecompress(uint8_t* uncompressed, int32_t length, uint8_t* refCompresse
 		if (compressedLength == refCompressedLength)
 		{
 			printf("It's a match!\n");
+			delete[] buffer;
 			return true;
 		}
 	}
 
 	uint8_t* uncompressedBuffer = new uint8_t[length];
-	HuffExpand(buffer, uncompressedBuffer, length, table);
+	HuffExpand(buffer, compressedLength, uncompressedBuffer, length, table);
+	delete[] buffer;
 	for (int n = 0; n < length; n++)
 	{
 		if (uncompressedBuffer[n] != uncompressed[n])
 		{
 			printf("Byte at index %d differs\n", n);
+			delete[] uncompressedBuffer;
 			return false;
 		}
 	}
 	
+	delete[] uncompressedBuffer;
 	return false;
 }
 
-void HuffExpand(byte *source, byte *dest, int32_t length, huffnode *hufftable)
+//
+// Reference decoder: one bit per step through the node array
+//
+void HuffExpandTreeWalk(byte *source, byte *dest, int32_t length, huffnode *hufftable)
 {
     byte *end;
     huffnode *headptr, *huffptr;
@@ -195,6 +331,138 @@ void HuffExpand(byte *source, byte *dest, int32_t length, huffnode *hufftable)
     }
 }
 
+//
+// Multi bit lookup table: indexed by the next lookupBits of input (first bit
+// in bit 0), each entry gives either a decoded byte or the node to carry on
+// walking from once all lookupBits are used up
+//
+#define HUFF_MAX_LOOKUP_BITS 12
+
+typedef struct
+{
+	uint16_t value;	// 0-255 is a character, > is node number + 256
+	uint8_t bits;	// input bits consumed to get here
+} hufflookup;
+
+typedef struct
+{
+	huffnode* hufftable;
+	int lookupBits;
+	hufflookup lookup[1 << HUFF_MAX_LOOKUP_BITS];
+} huffdecodetable;
+
+void HuffBuildDecodeTable(huffnode* hufftable, huffdecodetable* table, int lookupBits = 8)
+{
+	if(lookupBits < 1 || lookupBits > HUFF_MAX_LOOKUP_BITS)
+	{
+		printf("Bad huffman lookup size %d\n", lookupBits);
+		exit(1);
+	}
+	
+	table->hufftable = hufftable;
+	table->lookupBits = lookupBits;
+	
+	for(int index = 0; index < (1 << lookupBits); index++)
+	{
+		huffnode* huffptr = hufftable + 254;	// head node is always node 254
+		uint16_t nodeval;
+		int bits = 0;
+		
+		while(1)
+		{
+			nodeval = ((index >> bits) & 1) ? huffptr->bit1 : huffptr->bit0;
+			bits++;
+			
+			if(nodeval < 256 || bits == lookupBits)
+				break;
+			if(nodeval - 256 >= 255)
+			{
+				printf("Bad huffman table\n");
+				exit(1);
+			}
+			huffptr = hufftable + (nodeval - 256);
+		}
+		
+		table->lookup[index].value = nodeval;
+		table->lookup[index].bits = (uint8_t) bits;
+	}
+}
+
+//
+// Each lookup needs lookupBits of input buffered, so whole bytes are fetched
+// ahead of the code being decoded, up to (lookupBits + 7) / 8 past the last
+// one.  Source bytes past sourceLength aren't read and count as zero, so
+// sourceLength has to be the real length of the compressed data
+//
+void HuffExpand(byte *source, int32_t sourceLength, byte *dest, int32_t length, huffdecodetable *table)
+{
+    byte *end;
+
+    if(!length || !dest)
+    {
+        printf("length or dest is null!");
+		exit(1);
+        return;
+    }
+
+	huffnode* hufftable = table->hufftable;
+	int lookupBits = table->lookupBits;
+	uint32_t lookupMask = (1u << lookupBits) - 1;
+	
+	uint64_t bitBuffer = 0;
+	int bitCount = 0;
+	int32_t sourcePos = 0;
+
+    end=dest+length;
+
+	while(dest < end)
+	{
+		while(bitCount < lookupBits)
+		{
+			if(sourcePos < sourceLength)
+			{
+				bitBuffer |= (uint64_t) source[sourcePos] << bitCount;
+			}
+			sourcePos++;
+			bitCount += 8;
+		}
+		
+		hufflookup* entry = &table->lookup[bitBuffer & lookupMask];
+		bitBuffer >>= entry->bits;
+		bitCount -= entry->bits;
+		word nodeval = entry->value;
+		
+		// Codes longer than the lookup carry on a bit at a time
+		while(nodeval >= 256)
+		{
+			if(!bitCount)
+			{
+				if(sourcePos < sourceLength)
+				{
+					bitBuffer = source[sourcePos];
+				}
+				sourcePos++;
+				bitCount = 8;
+			}
+			
+			huffnode* huffptr = hufftable + (nodeval - 256);
+			nodeval = (bitBuffer & 1) ? huffptr->bit1 : huffptr->bit0;
+			bitBuffer >>= 1;
+			bitCount--;
+		}
+		
+		*dest++ = (byte) nodeval;
+	}
+}
+
+void HuffExpand(byte *source, int32_t sourceLength, byte *dest, int32_t length, huffnode *hufftable)
+{
+	huffdecodetable* table = new huffdecodetable;
+	HuffBuildDecodeTable(hufftable, table);
+	HuffExpand(source, sourceLength, dest, length, table);
+	delete table;
+}
+
 void TraceNode (int nodenum,int numbits,unsigned long bitstring)
 {
   unsigned bit0,bit1;
@@ -231,95 +499,303 @@ void TraceNode (int nodenum,int numbits,unsigned long bitstring)
     TraceNode (bit1-256,numbits,bitstring+(1ul<<(numbits-1)));
 }
 
-void Huffmanize (void)
-{
-
 //
-// codes are either bytes if <256 or nodearray numbers+256 if >=256
+// Longest code the engine side huffman tools have ever had to cope with
 //
-  unsigned value[256],code0,code1;
+#define HUFF_MAX_CODE_BITS 24
+
 //
-// probablilities are the number of times the code is hit or $ffffffff if
-// it is allready part of a higher node
+// Binary heap of (probability, slot).  Ties go to the lowest slot, which is
+// the same choice the original two linear scans made, so unlimited trees
+// come out node for node the same as they always have
 //
-  unsigned long prob[256],low,workprob;
+typedef struct
+{
+	uint64_t prob;
+	int slot;
+} huffheapentry;
+
+static bool HuffHeapLess(const huffheapentry& a, const huffheapentry& b)
+{
+	return a.prob < b.prob || (a.prob == b.prob && a.slot < b.slot);
+}
 
-  int i,worknode,bitlength;
-  unsigned long bitstring;
+static void HuffHeapPush(huffheapentry* heap, int& heapSize, huffheapentry entry)
+{
+	int i = heapSize++;
+	while(i > 0 && HuffHeapLess(entry, heap[(i - 1) / 2]))
+	{
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = entry;
+}
 
+static huffheapentry HuffHeapPop(huffheapentry* heap, int& heapSize)
+{
+	huffheapentry top = heap[0];
+	huffheapentry last = heap[--heapSize];
+	int i = 0;
+	
+	while(1)
+	{
+		int child = i * 2 + 1;
+		if(child >= heapSize)
+			break;
+		if(child + 1 < heapSize && HuffHeapLess(heap[child + 1], heap[child]))
+			child++;
+		if(!HuffHeapLess(heap[child], last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	
+	return top;
+}
 
 //
-// all possible leaves start out as bytes
+// Code lengths limited to maxBits with package-merge: each of maxBits levels
+// pairs up the cheapest items of the level below into packages and merges
+// them back in with the leaves.  The cheapest 2n-2 items at the top level
+// give each leaf's code length as the number of times it was picked
 //
-  for (i=0;i<256;i++)
-  {
-    value[i]=i;
-    prob[i]=counts[i];
-  }
+typedef struct
+{
+	uint64_t weight;
+	int symbol;		// -1 for a package
+	int left, right;
+} huffpackage;
+
+static void HuffCodeLengths(long* counts, int maxBits, int* lengths)
+{
+	static huffpackage pool[256 * 32];	// leaves plus a level of packages per bit
+	int poolSize = 0;
+	int leaves[256];
+	int list[512], packages[256], merged[512];
+	int listSize;
+	
+	// Leaves sorted by weight, ties by byte value
+	for(int i = 0; i < 256; i++)
+	{
+		int n = i;
+		while(n > 0 && (uint64_t) counts[leaves[n - 1]] > (uint64_t) counts[i])
+		{
+			leaves[n] = leaves[n - 1];
+			n--;
+		}
+		leaves[n] = i;
+	}
+	for(int i = 0; i < 256; i++)
+	{
+		pool[poolSize].weight = (uint64_t) counts[leaves[i]];
+		pool[poolSize].symbol = leaves[i];
+		pool[poolSize].left = pool[poolSize].right = -1;
+		list[i] = poolSize++;
+	}
+	listSize = 256;
+	
+	for(int level = 1; level < maxBits; level++)
+	{
+		int numPackages = 0;
+		for(int i = 0; i + 1 < listSize; i += 2)
+		{
+			pool[poolSize].weight = pool[list[i]].weight + pool[list[i + 1]].weight;
+			pool[poolSize].symbol = -1;
+			pool[poolSize].left = list[i];
+			pool[poolSize].right = list[i + 1];
+			packages[numPackages++] = poolSize++;
+		}
+		
+		// Merge packages back in with the leaves (pool[0-255]), leaves first on ties
+		int leaf = 0, package = 0;
+		listSize = 0;
+		while(leaf < 256 || package < numPackages)
+		{
+			if(package >= numPackages || (leaf < 256 && pool[leaf].weight <= pool[packages[package]].weight))
+				merged[listSize++] = leaf++;
+			else
+				merged[listSize++] = packages[package++];
+		}
+		memcpy(list, merged, listSize * sizeof(int));
+	}
+	
+	for(int i = 0; i < 256; i++)
+	{
+		lengths[i] = 0;
+	}
+	
+	int stack[64];		// one package per level being expanded plus its sibling
+	int stackSize = 0;
+	for(int i = 0; i < 2 * 256 - 2; i++)
+	{
+		stack[stackSize++] = list[i];
+		while(stackSize)
+		{
+			huffpackage* item = &pool[stack[--stackSize]];
+			if(item->symbol >= 0)
+			{
+				lengths[item->symbol]++;
+			}
+			else
+			{
+				stack[stackSize++] = item->left;
+				stack[stackSize++] = item->right;
+			}
+		}
+	}
+}
 
 //
-// start selecting the lowest probable leaves for the ends of the tree
+// Lays out a complete tree for a set of code lengths, head node 254 and the
+// rest numbered up from 0
 //
+static void HuffTreeFromLengths(int* lengths, huffnode* nodes)
+{
+	int order[256];
+	int numOrdered = 0;
+	int worknode = 0;
+	
+	for(int bits = 1; bits <= 32; bits++)
+	{
+		for(int i = 0; i < 256; i++)
+		{
+			if(lengths[i] == bits)
+				order[numOrdered++] = i;
+		}
+	}
+	if(numOrdered != 256)
+	{
+		printf("Wierdo huffman error: bad code length!");
+		exit(1);
+	}
+	
+	for(int i = 0; i < 255; i++)
+	{
+		nodes[i].bit0 = nodes[i].bit1 = 0xffff;
+	}
+	
+	// Canonical codes, sent most significant bit first
+	uint32_t code = 0;
+	for(int i = 0; i < 256; i++)
+	{
+		int symbol = order[i];
+		int bits = lengths[symbol];
+		
+		if(i > 0)
+		{
+			code = (code + 1) << (bits - lengths[order[i - 1]]);
+		}
+		
+		int node = 254;
+		for(int bit = bits - 1; bit >= 0; bit--)
+		{
+			uint16_t* child = ((code >> bit) & 1) ? &nodes[node].bit1 : &nodes[node].bit0;
+			
+			if(!bit)
+			{
+				*child = symbol;
+			}
+			else
+			{
+				if(*child == 0xffff)
+				{
+					if(worknode >= 254)
+					{
+						printf("Wierdo huffman error: too many nodes!");
+						exit(1);
+					}
+					*child = 256 + worknode++;
+				}
+				node = *child - 256;
+			}
+		}
+	}
+	
+	for(int i = 0; i < 255; i++)
+	{
+		if(nodes[i].bit0 == 0xffff || nodes[i].bit1 == 0xffff)
+		{
+			printf("Wierdo huffman error: tree isn't complete!");
+			exit(1);
+		}
+	}
+}
 
-  worknode = 0;
-  while (1)	// break out of when all codes have been used
-  {
-    //
-    // find the two lowest probability codes
-    //
-
-    code0=0xffff;
-    low = 0x7ffffffff;
-    for (i=0;i<256;i++)
-      if (prob[i]<low)
-      {
-	code0 = i;
-	low = prob[i];
-      }
-
-    code1=0xffff;
-    low = 0x7fffffff;
-    for (i=0;i<256;i++)
-      if (prob[i]<low && i != code0)
-      {
-	code1 = i;
-	low = prob[i];
-      }
-
-    if (code1 == 0xffff)
-    {
-      if (value[code0]<256)
-	  {
-		  printf("Wierdo huffman error: last code wasn't a node!");
-		  exit(1);
-	  }
-      if (value[code0]-256 != 254)
-	  {
+//
+// Builds a 255 node tree over counts with the head at node 254.  With
+// maxBits set, no code will be longer than that
+//
+void HuffBuildTree(long* counts, huffnode* nodes, int maxBits = 0)
+{
+	if(maxBits)
+	{
+		int lengths[256];
+		
+		if(maxBits < 8 || maxBits > 32)
+		{
+			printf("Can't limit huffman codes to %d bits\n", maxBits);
+			exit(1);
+		}
+		HuffCodeLengths(counts, maxBits, lengths);
+		HuffTreeFromLengths(lengths, nodes);
+		return;
+	}
+	
+//
+// codes are either bytes if <256 or nodearray numbers+256 if >=256
+//
+	unsigned value[256];
+	huffheapentry heap[256];
+	int heapSize = 0;
+	int worknode = 0;
+	
+//
+// all possible leaves start out as bytes
+//
+	for(int i = 0; i < 256; i++)
+	{
+		huffheapentry entry;
+		value[i] = i;
+		entry.prob = (uint64_t) counts[i];
+		entry.slot = i;
+		HuffHeapPush(heap, heapSize, entry);
+	}
+	
+//
+// join the two lowest probability codes until only the head is left, the
+// join takes over the slot of the first
+//
+	while(heapSize > 1)
+	{
+		huffheapentry code0 = HuffHeapPop(heap, heapSize);
+		huffheapentry code1 = HuffHeapPop(heap, heapSize);
+		
+		nodes[worknode].bit0 = value[code0.slot];
+		nodes[worknode].bit1 = value[code1.slot];
+		
+		value[code0.slot] = 256 + worknode;
+		code0.prob += code1.prob;
+		HuffHeapPush(heap, heapSize, code0);
+		worknode++;
+	}
+	
+	if(worknode != 255)
+	{
 		printf("Wierdo huffman error: headnode wasn't 254!");
 		exit(1);
-	  }
-      break;
-    }
+	}
+}
 
-    //
-    // make code0 into a pointer to work
-    // remove code1 (make 0xffffffff prob)
-    //
-    nodearray[worknode].bit0 = value[code0];
-    nodearray[worknode].bit1 = value[code1];
-
-    value[code0] = 256 + worknode;
-    prob[code0] += prob[code1];
-    prob[code1] = 0xffffffff;
-    worknode++;
-  }
+void Huffmanize (int maxBits = 0)
+{
+	HuffBuildTree(counts, nodearray, maxBits);
 
 //
 // done with tree, now build table recursively
 //
 
-  TraceNode (254,0,0);
-
+	TraceNode (254,0,0);
 }
 
 long HuffCompress (unsigned char* source, long length,
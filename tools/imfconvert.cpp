@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <memory.h>
+#include <string.h>
+#include "mappedfile.cpp"
+#include "jobs.cpp"
+#include "bench.cpp"
 
 struct AudioPacket
 {
@@ -38,6 +42,12 @@ struct Voice
 	int volume;
 	float onTime;
 	int currentOutputChannel;
+	
+	// WAV preview state, kept apart from the Tandy channel allocation
+	int wavOutputChannel;
+	bool wavMuted;
+	uint32_t phase;
+	uint32_t phaseStep;
 };
 
 struct WaveHeader
@@ -64,34 +74,57 @@ enum MixMethod
 	Mix_PlayLatest,
 	Mix_PlayLoudest,
 	Mix_ReplaceLoudest,
-	Mix_ByVoiceNumber
+	Mix_ByVoiceNumber,
+	NUM_MIX_METHODS
 };
 
-// PC speaker
-//#define HAS_VOLUME 0
-//#define HAS_NOISE_CHANNEL 0
-//#define MAX_CHANNELS 1
-//#define NOISE_CHANNEL MAX_CHANNELS
-//MixMethod mixMethod = Mix_PlayLoudest; //Mix_RoundRobin;
-
-// Tandy 3 voice
-#define HAS_VOLUME 1
-#define HAS_NOISE_CHANNEL 1
-#define MAX_CHANNELS 3
-#define NOISE_CHANNEL MAX_CHANNELS
-MixMethod mixMethod = Mix_PlayLoudest;
-
-//MixMethod mixMethod = Mix_RoundRobin;
-//MixMethod mixMethod = Mix_PlayLatest;
-//MixMethod mixMethod = Mix_ReplaceLatest; //Mix_ReplaceLoudest;
-//MixMethod mixMethod = Mix_ReplaceLoudest;
+const char* mixMethodNames[NUM_MIX_METHODS] =
+{
+	"roundrobin",
+	"replacelatest",
+	"playlatest",
+	"playloudest",
+	"replaceloudest",
+	"byvoice"
+};
 
-#define NUM_VOICES 9
+//
+// Describes the sound hardware being converted for.  The noise channel
+// number follows on from the tone channels
+//
+struct SoundProfile
+{
+	const char* name;
+	int maxChannels;
+	int noiseChannel;
+	bool hasVolume;
+	bool hasNoiseChannel;
+	MixMethod mixMethod;
+};
+
+enum SoundTarget
+{
+	Target_Tandy,
+	Target_Speaker,
+	NUM_SOUND_TARGETS
+};
+
+const SoundProfile soundTargets[NUM_SOUND_TARGETS] =
+{
+	// Tandy 3 voice
+	{ "tandy", 3, 3, true, true, Mix_PlayLoudest },
+	// PC speaker
+	{ "speaker", 1, 1, false, false, Mix_PlayLoudest }
+};
 
-Voice voices[NUM_VOICES];
+#define NUM_VOICES 9
 
 #define SAMPLE_RATE 44100
 
+// Music chunks follow the PC speaker, AdLib and digitised sound chunks
+// in AUDIOT (STARTMUSIC in AUDIOWL6.H)
+#define DEFAULT_START_MUSIC 261
+
 bool outputWav = true;
 bool outputTandy = true;
 
@@ -113,6 +146,74 @@ void PopulateWaveHeader(WaveHeader& header, uint32_t dataSize)
 }
 
 
+//
+// Output streams are built up in memory and written out in one go at the
+// end, so the many single byte writes don't each go through stdio.  This
+// also lets the WAV header be filled in once the sample count is known.
+//
+struct OutputBuffer
+{
+	uint8_t* data;
+	int size;
+	int capacity;
+};
+
+uint8_t* ReserveOutput(OutputBuffer* buffer, int count)
+{
+	if(buffer->size + count > buffer->capacity)
+	{
+		int newCapacity = buffer->capacity ? buffer->capacity * 2 : 64 * 1024;
+		while(newCapacity < buffer->size + count)
+		{
+			newCapacity *= 2;
+		}
+		
+		buffer->data = (uint8_t*) realloc(buffer->data, newCapacity);
+		if(!buffer->data)
+		{
+			printf("Out of memory\n");
+			exit(1);
+		}
+		buffer->capacity = newCapacity;
+	}
+	
+	uint8_t* result = buffer->data + buffer->size;
+	buffer->size += count;
+	return result;
+}
+
+void WriteOutput(OutputBuffer* buffer, uint8_t data)
+{
+	if(buffer->size < buffer->capacity)
+	{
+		buffer->data[buffer->size++] = data;
+	}
+	else
+	{
+		*ReserveOutput(buffer, 1) = data;
+	}
+}
+
+bool SaveOutput(OutputBuffer* buffer, const char* filename)
+{
+	FILE* fs = fopen(filename, "wb");
+	if(!fs)
+	{
+		printf("Could not open %s for writing\n", filename);
+		return false;
+	}
+	
+	bool success = fwrite(buffer->data, 1, buffer->size, fs) == (size_t) buffer->size;
+	fclose(fs);
+	return success;
+}
+
+void FreeOutput(OutputBuffer* buffer)
+{
+	free(buffer->data);
+	memset(buffer, 0, sizeof(OutputBuffer));
+}
+
 #define SOUND_FIRST_BYTE 0x80
 #define ATTENUATION_MASK 0x10
 
@@ -120,6 +221,10 @@ void PopulateWaveHeader(WaveHeader& header, uint32_t dataSize)
 
 #define TANDY_INTERRUPT_FREQUENCY 1000
 
+// Marks a wait in the raw stream.  Never a valid latch byte, and data bytes
+// only ever follow a frequency latch
+#define RAW_WAIT 0x00
+
 struct TandyChannel
 {
 	union
@@ -142,9 +247,35 @@ struct TandySoundStatus
 {
 	TandyChannel channels[4];
 	float accumulatedTime;
-} tandySoundStatus;
+};
+
+//
+// Everything that changes while converting a song, so that several songs
+// can be converted at once on different threads
+//
+struct SongState
+{
+	const SoundProfile* profile;
+	Voice voices[NUM_VOICES];
+	TandySoundStatus tandySoundStatus;
+	OutputBuffer* tandyOutput;
+	uint32_t noiseState;
+};
 
-FILE* tandyOutputFileStream;
+void InitSongState(SongState* state, const SoundProfile* profile, OutputBuffer* tandyOutput)
+{
+	memset(state, 0, sizeof(SongState));
+	state->profile = profile;
+	state->tandyOutput = tandyOutput;
+	state->noiseState = 0x12345678;
+	
+	for(int v = 0; v < NUM_VOICES; v++)
+	{
+		state->voices[v].currentOutputChannel = -1;
+		state->voices[v].wavOutputChannel = -1;
+		state->voices[v].wavMuted = false;
+	}
+}
 
 int GetFValue(float frequency)
 {
@@ -165,7 +296,7 @@ float BinFrequency(float frequency)
 	return (3579545.0f / (fvalue * 32));
 }
 
-void WriteFrequency(FILE* fs, int channel, int fvalue)
+void WriteFrequency(OutputBuffer* out, int channel, int fvalue)
 {
 	// Frequency
 	uint8_t channelBits = (channel & 3) << 5;
@@ -173,216 +304,528 @@ void WriteFrequency(FILE* fs, int channel, int fvalue)
 	uint8_t data;
 	//data = SOUND_FIRST_BYTE | channelBits | ((uint8_t)(fvalue >> 6) & 0xf);
 	data = SOUND_FIRST_BYTE | channelBits | ((uint8_t)(fvalue & 0xf));
-	fwrite(&data, 1, 1, fs);
+	WriteOutput(out, data);
 	
 	data = (uint8_t)(fvalue >> 4) & 0x3f;
-	fwrite(&data, 1, 1, fs);
+	WriteOutput(out, data);
 }
 
-void WriteAttenuation(FILE* fs, int channel, int attenuation)
+void WriteAttenuation(OutputBuffer* out, int channel, int attenuation, bool isNoise)
 {
-	if(channel != NOISE_CHANNEL)
+	if(!isNoise)
 		attenuation = attenuation == 0xf ? 0xf : 0x5;
 	
 	uint8_t channelBits = (channel & 3) << 5;
 	uint8_t data = SOUND_FIRST_BYTE | channelBits | ATTENUATION_MASK | (attenuation & 0xf);
-	
-	if(data == 0xfe)
-	{
-		printf("ERROR\n");
-		exit(1);
-	}
-	
-	fwrite(&data, 1, 1, fs);
+	WriteOutput(out, data);
 }
 
-void WriteNoiseType(FILE* fs, int noiseBits)
+void WriteNoiseType(OutputBuffer* out, int noiseBits)
 {
 	// Noise type
 	uint8_t data = SOUND_FIRST_BYTE | NOISE_CHANNEL_MASK | noiseBits;
-	
-	if(data == 0xfe)
+	WriteOutput(out, data);
+}
+
+void WriteWait(OutputBuffer* out, float ms)
+{
+	int wait = (int)((ms * TANDY_INTERRUPT_FREQUENCY) / 1000);
+
+	do
+	{
+		int chunk = wait > 65535 ? 65535 : wait;
+		
+		WriteOutput(out, RAW_WAIT);
+		WriteOutput(out, (uint8_t)(chunk & 0xff));
+		WriteOutput(out, (uint8_t)(chunk >> 8));
+		
+		wait -= chunk;
+	} while(wait > 0);
+}
+
+//
+// The stream built by Flush() is a raw log: every dirty register is written
+// on every flush, followed by RAW_WAIT and a 16 bit tick count which may be
+// zero.  OptimiseTandyStream() replays it against a model of the sound chip
+// registers and writes the final .tdy encoding:
+//
+//  0x00 - 0x7f   wait (n + 1) ticks
+//  0xfe lo hi    wait lo | (hi << 8) ticks, or if that is zero, send 0xfe
+//  anything else send to the sound chip.  A tone frequency latch is
+//                followed by its data byte, which is sent as is
+//
+// Register writes are only kept if they change the chip's state by the time
+// the next tick plays, and adjacent waits are merged.
+//
+#define TANDY_SHORT_WAIT_MAX 0x80
+#define TANDY_LONG_WAIT 0xfe
+#define TANDY_NUM_REGISTERS 8
+
+bool IsTandyFrequencyLatch(uint8_t data)
+{
+	return (data & 0x90) == 0x80 && (data & 0x60) != 0x60;
+}
+
+void WriteTandyWait(OutputBuffer* out, int wait)
+{
+	while(wait > 0)
 	{
-		printf("ERROR\n");
-		exit(1);
+		if(wait <= TANDY_SHORT_WAIT_MAX)
+		{
+			WriteOutput(out, (uint8_t)(wait - 1));
+			return;
+		}
+		
+		int chunk = wait > 65535 ? 65535 : wait;
+		WriteOutput(out, TANDY_LONG_WAIT);
+		WriteOutput(out, (uint8_t)(chunk & 0xff));
+		WriteOutput(out, (uint8_t)(chunk >> 8));
+		wait -= chunk;
 	}
-	fwrite(&data, 1, 1, fs);
 }
 
-void WriteWait(FILE* fs, float ms)
+void WriteTandyRegister(OutputBuffer* out, int reg, int value)
 {
-	int wait = (int)((ms * TANDY_INTERRUPT_FREQUENCY) / 1000);
+	uint8_t latch = SOUND_FIRST_BYTE | (reg << 4) | (value & 0xf);
+	
+	if(latch == TANDY_LONG_WAIT)
+	{
+		// Escaped as a zero length wait
+		WriteOutput(out, TANDY_LONG_WAIT);
+		WriteOutput(out, 0);
+		WriteOutput(out, 0);
+		return;
+	}
+	
+	WriteOutput(out, latch);
+	if(IsTandyFrequencyLatch(latch))
+	{
+		WriteOutput(out, (uint8_t)(value >> 4) & 0x3f);
+	}
+}
 
-	if(wait > 65535)
+void OptimiseTandyStream(const OutputBuffer* raw, OutputBuffer* out)
+{
+	int current[TANDY_NUM_REGISTERS];
+	int pending[TANDY_NUM_REGISTERS];
+	int pendingWait = 0;
+	
+	for(int n = 0; n < TANDY_NUM_REGISTERS; n++)
 	{
-		wait = 65535;
+		// Nothing is known about the chip until it has been written to
+		current[n] = pending[n] = -1;
+	}
+	
+	int pos = 0;
+	while(pos < raw->size)
+	{
+		uint8_t data = raw->data[pos++];
+		
+		if(data == RAW_WAIT)
+		{
+			int wait = raw->data[pos] | (raw->data[pos + 1] << 8);
+			pos += 2;
+			
+			if(!wait)
+			{
+				// Anything written now will be overwritten before it is heard
+				continue;
+			}
+			
+			bool changed = false;
+			for(int n = 0; n < TANDY_NUM_REGISTERS; n++)
+			{
+				if(pending[n] != current[n])
+				{
+					changed = true;
+					break;
+				}
+			}
+			
+			if(changed)
+			{
+				WriteTandyWait(out, pendingWait);
+				pendingWait = 0;
+				
+				for(int n = 0; n < TANDY_NUM_REGISTERS; n++)
+				{
+					if(pending[n] != current[n])
+					{
+						WriteTandyRegister(out, n, pending[n]);
+						current[n] = pending[n];
+					}
+				}
+			}
+			
+			pendingWait += wait;
+		}
+		else
+		{
+			int reg = (data >> 4) & 7;
+			int value = data & 0xf;
+			
+			if(IsTandyFrequencyLatch(data))
+			{
+				value |= raw->data[pos++] << 4;
+			}
+			
+			pending[reg] = value;
+		}
 	}
 	
-	uint8_t data = 0xfe;
-	fwrite(&data, 1, 1, fs);
+	WriteTandyWait(out, pendingWait);
+}
+
+bool SaveTandyStream(const OutputBuffer* raw, const char* filename, int* optimisedSize)
+{
+	OutputBuffer optimised;
+	memset(&optimised, 0, sizeof(OutputBuffer));
 	
-	data = (uint8_t)(wait & 0xff);
-	fwrite(&data, 1, 1, fs);
+	OptimiseTandyStream(raw, &optimised);
+	bool success = SaveOutput(&optimised, filename);
 	
-	data = (uint8_t)(wait >> 8);
-	fwrite(&data, 1, 1, fs);
+	if(optimisedSize)
+	{
+		*optimisedSize = optimised.size;
+	}
+	FreeOutput(&optimised);
+	return success;
 }
 
-void Flush()
+void Flush(SongState* state)
 {
-	if(tandySoundStatus.accumulatedTime > 0)
+	TandySoundStatus& status = state->tandySoundStatus;
+	int noiseChannel = state->profile->noiseChannel;
+	
+	if(status.accumulatedTime > 0)
 	{
-		if(tandyOutputFileStream)
+		if(state->tandyOutput)
 		{
 			for(int c = 0; c < 4; c++)
 			{
-				if(c == NOISE_CHANNEL)
+				if(c == noiseChannel)
 				{
-					if(tandySoundStatus.channels[c].noiseTypeDirty)
+					if(status.channels[c].noiseTypeDirty)
 					{
-						WriteNoiseType(tandyOutputFileStream, tandySoundStatus.channels[c].noiseType);
-						tandySoundStatus.channels[c].noiseTypeDirty = false;
+						WriteNoiseType(state->tandyOutput, status.channels[c].noiseType);
+						status.channels[c].noiseTypeDirty = false;
 					}
 				}
 				else
 				{
-					if(tandySoundStatus.channels[c].frequencyDirty)
+					if(status.channels[c].frequencyDirty)
 					{
-						WriteFrequency(tandyOutputFileStream, c, tandySoundStatus.channels[c].fvalue);
-						tandySoundStatus.channels[c].frequencyDirty = false;
+						WriteFrequency(state->tandyOutput, c, status.channels[c].fvalue);
+						status.channels[c].frequencyDirty = false;
 					}
 				}
-				if(tandySoundStatus.channels[c].attenuationDirty)
+				if(status.channels[c].attenuationDirty)
 				{
-					WriteAttenuation(tandyOutputFileStream, c, tandySoundStatus.channels[c].attenuation);
-					tandySoundStatus.channels[c].attenuationDirty = false;
+					WriteAttenuation(state->tandyOutput, c, status.channels[c].attenuation, c == noiseChannel);
+					status.channels[c].attenuationDirty = false;
 				}
 			}
 			
-			WriteWait(tandyOutputFileStream, tandySoundStatus.accumulatedTime);
+			WriteWait(state->tandyOutput, status.accumulatedTime);
 		}
 		
-		tandySoundStatus.accumulatedTime = 0;
+		status.accumulatedTime = 0;
 	}
 }
 
-void EmitDelay(float ms)
+void EmitDelay(SongState* state, float ms)
 {
-	tandySoundStatus.accumulatedTime += ms;
+	state->tandySoundStatus.accumulatedTime += ms;
 }
 
-void EmitNoiseType(int noiseType, int noiseShift)
+void EmitNoiseType(SongState* state, int noiseType, int noiseShift)
 {
+	TandyChannel& channel = state->tandySoundStatus.channels[state->profile->noiseChannel];
 	int noiseBits = ((noiseType & 1) << 2) | (noiseShift & 3);
 	
-	if(tandySoundStatus.channels[NOISE_CHANNEL].noiseType == noiseBits)
+	if(channel.noiseType == noiseBits)
 	{
 		return;
 	}
 	
-	Flush();
+	Flush(state);
 	
-	tandySoundStatus.channels[NOISE_CHANNEL].noiseType = noiseBits;
-	tandySoundStatus.channels[NOISE_CHANNEL].noiseTypeDirty = true;
+	channel.noiseType = noiseBits;
+	channel.noiseTypeDirty = true;
 }
 
-void EmitFrequencyChange(int channel, float frequency)
+void EmitFrequencyChange(SongState* state, int channel, float frequency)
 {
 	int fvalue = GetFValue(frequency);
 		
-	if(tandySoundStatus.channels[channel].fvalue == fvalue)
+	if(state->tandySoundStatus.channels[channel].fvalue == fvalue)
 		return;
 
-	Flush();
+	Flush(state);
 
-	tandySoundStatus.channels[channel].fvalue = fvalue;
-	tandySoundStatus.channels[channel].frequencyDirty = true;
+	state->tandySoundStatus.channels[channel].fvalue = fvalue;
+	state->tandySoundStatus.channels[channel].frequencyDirty = true;
 }
 
-void EmitVolumeChange(int channel, int volume)
+void EmitVolumeChange(SongState* state, int channel, int volume)
 {
 	int attenuation = 0xf - volume; // (volume == 0) ? 0xf : volume - 1;
 
-	if(tandySoundStatus.channels[channel].attenuation == attenuation)
+	if(state->tandySoundStatus.channels[channel].attenuation == attenuation)
 		return;
 		
-	Flush();
+	Flush(state);
 
-	tandySoundStatus.channels[channel].attenuation = attenuation;
-	tandySoundStatus.channels[channel].attenuationDirty = true;
+	state->tandySoundStatus.channels[channel].attenuation = attenuation;
+	state->tandySoundStatus.channels[channel].attenuationDirty = true;
 }
 
-int main(int argc, char* argv[])
+//
+// WAV preview synthesis.  Each voice has a 32 bit phase accumulator stepped
+// once per sample, and the top bits index a table for the carrier's OPL
+// waveform.  Voices are only assigned to output channels once per packet,
+// since that is the only time anything about them can change.
+//
+#define WAVE_TABLE_BITS 10
+#define WAVE_TABLE_SIZE (1 << WAVE_TABLE_BITS)
+
+enum WaveTable
+{
+	Wave_Sine,
+	Wave_HalfSine,
+	Wave_AbsSine,
+	Wave_QuarterSine,
+	Wave_Square,
+	NUM_WAVE_TABLES
+};
+
+// The Tandy and PC speaker can only make square waves, so preview with
+// those by default.  Set to false to hear the OPL waveforms instead
+bool previewSquareWave = true;
+
+int8_t waveTables[NUM_WAVE_TABLES][WAVE_TABLE_SIZE];
+
+void GenerateWaveTables()
 {
-	if(argc != 2)
+	for(int n = 0; n < WAVE_TABLE_SIZE; n++)
 	{
-		printf("Usage: %s [filename]\n", argv[0]);
-		return 0;
+		double s = sin((n * 2.0 * 3.14159265358979) / WAVE_TABLE_SIZE);
+		int8_t value = (int8_t)(s * 127);
+		int quarter = (n * 4) / WAVE_TABLE_SIZE;
+		
+		waveTables[Wave_Sine][n] = value;
+		waveTables[Wave_HalfSine][n] = value > 0 ? value : 0;
+		waveTables[Wave_AbsSine][n] = value > 0 ? value : -value;
+		waveTables[Wave_QuarterSine][n] = (quarter & 1) ? 0 : (value > 0 ? value : -value);
+		// Matches the old preview, which was high for the second half of each cycle
+		waveTables[Wave_Square][n] = n >= WAVE_TABLE_SIZE / 2 ? 127 : 0;
 	}
+}
+
+void AssignWavChannels(SongState* state, float time)
+{
+	Voice* voices = state->voices;
+	const SoundProfile* profile = state->profile;
+	MixMethod mixMethod = profile->mixMethod;
 	
-	FILE* fs = fopen(argv[1], "rb");
-	if(!fs)
+	for(int v = 0; v < NUM_VOICES; v++)
 	{
-		printf("Could not open %s\n", argv[1]);
-		return 0;
+		voices[v].wavOutputChannel = -1;
+
+		voices[v].noise = voices[v].mfm[0] >= 6 || voices[v].mfm[1] >= 6;
+		if(profile->hasNoiseChannel && voices[v].noise)
+		{
+			voices[v].wavOutputChannel = profile->noiseChannel;
+		}
 	}
+
+	int start = 0;
 	
-	for(int v = 0; v < NUM_VOICES; v++)
+	if(mixMethod == Mix_RoundRobin)
 	{
-		voices[v].currentOutputChannel = -1;
+		start = ((int)(time * 70 / 1000)) % NUM_VOICES;
 	}
 	
-	//voices[1].noise = true;
-	//voices[8].noise = true;
-	//voices[5].noise = true;
-	//voices[8].noise = true;
-
-	// GETTHEM
-	//voices[1].noise = true;
+	for(int c = 0; c < profile->maxChannels; c++)
+	{
+		int bestVoice = -1;
+		for(int i = 0; i < NUM_VOICES; i++)
+		{
+			int v = (start + i) % NUM_VOICES;
+			if(voices[v].on && !voices[v].wavMuted && voices[v].wavOutputChannel == -1)
+			{
+				if(mixMethod == Mix_RoundRobin || mixMethod == Mix_ByVoiceNumber)
+				{
+					bestVoice = v;
+					break;
+				}
+				else
+				{
+					switch(mixMethod)
+					{
+						case Mix_ReplaceLatest:
+						case Mix_PlayLatest:
+						if(bestVoice == -1 || voices[v].onTime > voices[bestVoice].onTime)
+						{
+							bestVoice = v;
+						}
+						break;
+						
+						case Mix_ReplaceLoudest:
+						case Mix_PlayLoudest:
+						if(bestVoice == -1 || voices[v].volume > voices[bestVoice].volume)
+						{
+							bestVoice = v;
+						}
+						else if(voices[v].volume == voices[bestVoice].volume)
+						{
+							if(voices[v].onTime > voices[bestVoice].onTime)
+							{
+								bestVoice = v;
+							}
+						}
+						break;
+						
+						default:
+						break;
+					}
+				}
+			}
+		}	
+		if(bestVoice != -1)
+		{
+			voices[bestVoice].wavOutputChannel = c;
+		}
+	}
 	
-	// WARMARCH
-	//voices[1].noise = true;
+	// A voice that loses its channel stays silent in the preview until it is
+	// keyed again.  Only the WAV side is muted so the Tandy output doesn't
+	// depend on the preview's mix method
+	if(mixMethod == Mix_ReplaceLatest || mixMethod == Mix_ReplaceLoudest)
+	{
+		for(int v = 0; v < NUM_VOICES; v++)
+		{
+			if(voices[v].wavOutputChannel == -1)
+				voices[v].wavMuted = true;
+		}				
+	}
 	
+	for(int v = 0; v < NUM_VOICES; v++)
+	{
+		float frequency = BinFrequency(voices[v].frequency);
+		voices[v].phaseStep = (uint32_t)((frequency * 4294967296.0) / SAMPLE_RATE);
+	}
+}
+
+void RenderWavSamples(SongState* state, OutputBuffer* out, int samplesToMake)
+{
+	Voice* voices = state->voices;
+	const SoundProfile* profile = state->profile;
 	
-	WaveHeader waveHeader;
-	FILE* fout;
 
-	if(outputWav)
+	struct ActiveVoice
+	{
+		Voice* voice;
+		const int8_t* table;
+		int amplitude;
+	} active[NUM_VOICES];
+	int numActive = 0;
+	int noiseStrength = 0;
+	
+	for(int v = 0; v < NUM_VOICES; v++)
 	{
-		fout = fopen("out.wav", "wb");
-		fwrite(&waveHeader, sizeof(WaveHeader), 1, fout);
+		if(!voices[v].on || voices[v].wavMuted || voices[v].wavOutputChannel == -1)
+		{
+			continue;
+		}
+		
+		if(voices[v].wavOutputChannel == profile->noiseChannel)
+		{
+			if(voices[v].volume > noiseStrength)
+			{
+				noiseStrength = voices[v].volume;
+			}
+		}
+		else
+		{
+			active[numActive].voice = &voices[v];
+			active[numActive].table = waveTables[previewSquareWave ? Wave_Square : voices[v].waveform[1]];
+			active[numActive].amplitude = profile->hasVolume ? voices[v].volume + 1 : 32;
+			numActive++;
+		}
 	}
 	
-	if(outputTandy)
+	if(samplesToMake <= 0)
 	{
-		tandyOutputFileStream = fopen("out.tdy", "wb");
+		return;
 	}
 	
-	uint16_t musicSize;
-	fread(&musicSize, sizeof(uint16_t), 1, fs);
+	uint8_t* samples = ReserveOutput(out, samplesToMake);
 	
-	if(musicSize)
+	for(int n = 0; n < samplesToMake; n++)
 	{
-		printf("Size: %d\n", musicSize);
+		int sample = 127;
+			
+		for(int i = 0; i < numActive; i++)
+		{
+			Voice* voice = active[i].voice;
+			sample += (active[i].table[voice->phase >> (32 - WAVE_TABLE_BITS)] * active[i].amplitude) >> 7;
+			voice->phase += voice->phaseStep;
+		}
+		
+		if(noiseStrength)
+		{
+			state->noiseState ^= state->noiseState << 13;
+			state->noiseState ^= state->noiseState >> 17;
+			state->noiseState ^= state->noiseState << 5;
+			sample += (int)(state->noiseState % (noiseStrength / 2 + 1));
+		}
+		
+		samples[n] = (uint8_t)(sample < 0 ? 0 : (sample > 255 ? 255 : sample));
 	}
-	else
+}
+
+//
+// Converts one song.  The data is either a raw IMF file or starts with a
+// 16 bit length, as in AUDIOT.  The Tandy stream goes to the state's output
+// and the preview samples to wavOutput, if there is one
+//
+void ConvertSong(SongState* state, const uint8_t* data, int length, OutputBuffer* wavOutput)
+{
+	Voice* voices = state->voices;
+	
+	uint16_t musicSize = 0;
+	int pos = 0;
+	
+	if(length >= 2)
 	{
-		fseek(fs, 0, SEEK_SET);
+		musicSize = data[0] | (data[1] << 8);
+		if(musicSize)
+		{
+			pos = 2;
+		}
+	}
+	
+	if(wavOutput)
+	{
+		// Header is filled in once the sample count is known
+		memset(ReserveOutput(wavOutput, sizeof(WaveHeader)), 0, sizeof(WaveHeader));
 	}
 	
 	int sampleCount = 0;
 	int bytesRead = 0;
 	float time = 0;
+	int64_t totalDelay = 0;
 
-	EmitNoiseType(1, 0);
+	EmitNoiseType(state, 1, 0);
 	
-	while(!feof(fs))
+	while(pos + (int) sizeof(AudioPacket) <= length)
 	{
 		AudioPacket packet;
-		if(!fread(&packet, sizeof(AudioPacket), 1, fs))
-		{
-			break;
-		}
+		packet.reg = data[pos];
+		packet.data = data[pos + 1];
+		packet.delay = data[pos + 2] | (data[pos + 3] << 8);
+		pos += sizeof(AudioPacket);
 		bytesRead += sizeof(AudioPacket);
 		
 		float ms = (packet.delay * 1000.0f) / 700;
@@ -397,6 +840,7 @@ int main(int argc, char* argv[])
 			
 			voices[voicenum].fvalue = ((packet.data & 0x3) << 8) | (voices[voicenum].fvalue & 0xff);
 			voices[voicenum].on = (packet.data & 0x20) != 0;
+			voices[voicenum].wavMuted = false;
 			voices[voicenum].block = (packet.data & 0x1c) >> 2;
 			
 			// Music Frequency = (F-Num * 49716) / (2^(20-Block))
@@ -412,7 +856,7 @@ int main(int argc, char* argv[])
 				{
 					if(voices[voicenum].currentOutputChannel == -1)
 					{
-						for(int c = 0; c < MAX_CHANNELS; c++)
+						for(int c = 0; c < state->profile->maxChannels; c++)
 						{
 							bool channelUsed = false;
 							for(int i = 0; i < NUM_VOICES; i++)
@@ -435,7 +879,7 @@ int main(int argc, char* argv[])
 						if(voices[voicenum].currentOutputChannel == -1)
 						{
 							int bestReplacementVoice = -1;
-							for(int c = 0; c < MAX_CHANNELS; c++)
+							for(int c = 0; c < state->profile->maxChannels; c++)
 							{
 								for(int i = 0; i < NUM_VOICES; i++)
 								{
@@ -462,8 +906,8 @@ int main(int argc, char* argv[])
 					
 					if(voices[voicenum].currentOutputChannel != -1)
 					{
-						EmitFrequencyChange(voices[voicenum].currentOutputChannel, voices[voicenum].frequency);
-						EmitVolumeChange(voices[voicenum].currentOutputChannel, voices[voicenum].volume);
+						EmitFrequencyChange(state, voices[voicenum].currentOutputChannel, voices[voicenum].frequency);
+						EmitVolumeChange(state, voices[voicenum].currentOutputChannel, voices[voicenum].volume);
 					}
 				}
 			}
@@ -472,7 +916,7 @@ int main(int argc, char* argv[])
 				// Key off
 				if(voices[voicenum].currentOutputChannel != -1)
 				{
-					EmitVolumeChange(voices[voicenum].currentOutputChannel, 0);
+					EmitVolumeChange(state, voices[voicenum].currentOutputChannel, 0);
 					voices[voicenum].currentOutputChannel = -1;
 				}
 			}
@@ -516,8 +960,8 @@ int main(int argc, char* argv[])
 			
 			if(voices[voicenum].currentOutputChannel != -1)
 			{
-				EmitFrequencyChange(voices[voicenum].currentOutputChannel, voices[voicenum].frequency);
-				EmitVolumeChange(voices[voicenum].currentOutputChannel, voices[voicenum].volume);
+				EmitFrequencyChange(state, voices[voicenum].currentOutputChannel, voices[voicenum].frequency);
+				EmitVolumeChange(state, voices[voicenum].currentOutputChannel, voices[voicenum].volume);
 			}
 		}
 		else if(packet.reg >= 0x80 && packet.reg <= 0x95)
@@ -534,7 +978,7 @@ int main(int argc, char* argv[])
 				
 				if(voices[voicenum].currentOutputChannel != -1)
 				{
-					EmitVolumeChange(voices[voicenum].currentOutputChannel, voices[voicenum].volume);
+					EmitVolumeChange(state, voices[voicenum].currentOutputChannel, voices[voicenum].volume);
 				}
 			}
 		}
@@ -592,7 +1036,7 @@ int main(int argc, char* argv[])
 				
 				if(voices[voicenum].noise && voices[voicenum].currentOutputChannel != -1)
 				{
-					EmitVolumeChange(voices[voicenum].currentOutputChannel, 0);
+					EmitVolumeChange(state, voices[voicenum].currentOutputChannel, 0);
 					voices[voicenum].currentOutputChannel = -1;
 				}
 
@@ -623,330 +1067,495 @@ int main(int argc, char* argv[])
 				break;
 			}
 		}
-		EmitVolumeChange(NOISE_CHANNEL, noiseOn ? 2 : 0);
+		EmitVolumeChange(state, state->profile->noiseChannel, noiseOn ? 2 : 0);
 			
 		
-		EmitDelay(ms);
+		EmitDelay(state, ms);
 		
-		#if 0
-		if(outputWav)
+		if(wavOutput)
 		{
-			int samplesToMake = (int)((SAMPLE_RATE * ms) / 1000);
-			
-			for(int n = 0; n < samplesToMake; n++)
-			{
-				uint8_t out = 127;
-				float seconds = (float) sampleCount / SAMPLE_RATE;
-
-				for(int v = 0; v < NUM_VOICES; v++)
-				{
-					voices[v].currentOutputChannel = -1;
-
-					voices[v].noise = voices[v].mfm[0] >= 6 || voices[v].mfm[1] >= 6;
-	#if HAS_NOISE_CHANNEL
-					if(voices[v].noise)
-					{
-						voices[v].currentOutputChannel = NOISE_CHANNEL;
-					}
-	#endif
-				}
+			totalDelay += packet.delay;
+			AssignWavChannels(state, time);
+			RenderWavSamples(state, wavOutput, (int)((totalDelay * SAMPLE_RATE) / 700) - sampleCount);
+			sampleCount = (int)((totalDelay * SAMPLE_RATE) / 700);
+		}
+		
+		if(musicSize && bytesRead >= musicSize)
+		{
+			break;
+		}
+	}
+	
+	if(wavOutput)
+	{
+		WaveHeader waveHeader;
+		PopulateWaveHeader(waveHeader, sampleCount);
+		memcpy(wavOutput->data, &waveHeader, sizeof(WaveHeader));
+	}
+}
 
-				int start = 0;
-				
-				if(mixMethod == Mix_RoundRobin)
-				{
-					start = ((int)(seconds * 70)) % NUM_VOICES;
-					//start = sampleCount % NUM_VOICES;
-				}
-				
-				for(int c = 0; c < MAX_CHANNELS; c++)
-				{
-					int bestVoice = -1;
-					for(int i = 0; i < NUM_VOICES; i++)
-					{
-						int v = (start + i) % NUM_VOICES;
-						if(voices[v].on && voices[v].currentOutputChannel == -1)
-						{
-							if(mixMethod == Mix_RoundRobin || mixMethod == Mix_ByVoiceNumber)
-							{
-								bestVoice = v;
-								break;
-							}
-							else
-							{
-								switch(mixMethod)
-								{
-									case Mix_ReplaceLatest:
-									case Mix_PlayLatest:
-									if(bestVoice == -1 || voices[v].onTime > voices[bestVoice].onTime)
-									{
-										bestVoice = v;
-									}
-									break;
-									
-									case Mix_ReplaceLoudest:
-									case Mix_PlayLoudest:
-									if(bestVoice == -1 || voices[v].volume > voices[bestVoice].volume)
-									{
-										bestVoice = v;
-									}
-									else if(voices[v].volume == voices[bestVoice].volume)
-									{
-										if(voices[v].onTime > voices[bestVoice].onTime)
-										{
-											bestVoice = v;
-										}
-									}
-									break;
-								}
-							}
-						}
-					}	
-					if(bestVoice != -1)
-					{
-						voices[bestVoice].currentOutputChannel = c;
-					}
-					//channelAllocation[c] = bestVoice;
-				}
-				
-				if(mixMethod == Mix_ReplaceLatest || mixMethod == Mix_ReplaceLoudest)
-				{
-					for(int v = 0; v < NUM_VOICES; v++)
-					{
-						if(voices[v].currentOutputChannel == -1)
-							voices[v].on = false;
-					}				
-				}
-				
-				int noiseStrength = 0;
-				
-				for(int v = 0; v < NUM_VOICES; v++)
-				{
-					bool canPlay = voices[v].currentOutputChannel != -1;
-					
-					if(voices[v].on && canPlay)
-					{
-						if(voices[v].currentOutputChannel != NOISE_CHANNEL)
-						{
-							float frequency = BinFrequency(voices[v].frequency);
-							float phase = seconds * frequency;
-							float f = sin(phase * 3.1415 * 2);
-							float phasefrac = phase - (int) phase;
-							
-							/*
-							if(f > 0)
-							{
-								#if HAS_VOLUME
-								out += voices[v].volume + 1;
-								#else
-								out = 32;
-								#endif
-							}*/
-							
-							// Square wave
-							if(phasefrac > 0.5f)
-							{
-								out += voices[v].volume + 1;							
-							}
-							
-							// Triangle wave
-							//out += (int)((voices[v].volume + 1) * phasefrac);
-							
-							// Sine wave
-							//out += (int)(voices[v].volume * f);
-							
-							/*if(f > 0)
-							{
-								out += 14;
-							}
-							else
-							{
-								out -= 14;
-							}*/
-						}
-						else
-						{
-							if(voices[v].volume > noiseStrength)
-							{
-								noiseStrength = (voices[v].volume);
-							}
-						}
-					}
-				}
-				
-				#if HAS_NOISE_CHANNEL
-				if(noiseStrength)
-				{
-					out += (uint8_t)(rand() % (noiseStrength / 2 + 1));
-				}
-				#endif
-							
-				fwrite(&out, 1, 1, fout);
-				sampleCount++;
-			}
+void PrintVoiceReport(SongState* state)
+{
+	Voice* voices = state->voices;
+	
+	for(int v = 0; v < NUM_VOICES; v++)
+	{
+		if(!voices[v].used)
+			continue;
+		
+		printf("Voice %d:\n", v);
+		printf(" Feedback: %d Algorithm: %d\n", voices[v].feedback, voices[v].algorithm);
+		for(int op = 0; op < 2; op++)
+		{
+			printf(" [%d] ", op + 1);
+			printf("Attack: %d Decay: %d Sustain: %d Release: %d\n", voices[v].attack[op], voices[v].decay[op],  voices[v].sustain[op], voices[v].release[op]);
+			printf("      ampmod: %d vib: %d egt: %d ksr: %d mfm: %d\n", voices[v].ampmod[op], voices[v].vib[op], voices[v].egt[op], voices[v].ksr[op], voices[v].mfm[op]);
+
+			printf("\n");
+		}
+	}
+	
+}
+
+const SoundProfile* FindSoundTarget(const char* name)
+{
+	for(int n = 0; n < NUM_SOUND_TARGETS; n++)
+	{
+		if(!strcmp(soundTargets[n].name, name))
+			return &soundTargets[n];
+	}
+	return NULL;
+}
+
+int FindMixMethod(const char* name)
+{
+	for(int n = 0; n < NUM_MIX_METHODS; n++)
+	{
+		if(!strcmp(mixMethodNames[n], name))
+			return n;
+	}
+	return -1;
+}
+
+int ConvertFile(const char* filename, SoundProfile profile)
+{
+	MappedFile file;
+	if(!MapFile(filename, &file))
+	{
+		printf("Could not open %s\n", filename);
+		return 0;
+	}
+	
+	if(file.size >= 2 && (file.data[0] | file.data[1]))
+	{
+		printf("Size: %d\n", file.data[0] | (file.data[1] << 8));
+	}
+	
+	OutputBuffer wavOutput;
+	OutputBuffer tandyOutput;
+	memset(&wavOutput, 0, sizeof(OutputBuffer));
+	memset(&tandyOutput, 0, sizeof(OutputBuffer));
+	
+	SongState* state = new SongState;
+	InitSongState(state, &profile, outputTandy ? &tandyOutput : NULL);
+	ConvertSong(state, file.data, (int) file.size, outputWav ? &wavOutput : NULL);
+	UnmapFile(&file);
+	
+	if(outputWav)
+	{
+		SaveOutput(&wavOutput, "out.wav");
+		FreeOutput(&wavOutput);
+	}
+	
+	if(outputTandy)
+	{
+		int optimisedSize;
+		SaveTandyStream(&tandyOutput, "out.tdy", &optimisedSize);
+		printf("Tandy stream: %d bytes (%d before optimising)\n", optimisedSize, tandyOutput.size);
+		FreeOutput(&tandyOutput);
+	}
+	
+	PrintVoiceReport(state);
+	delete state;
+	
+	return 0;
+}
+
+//
+// Converts every music chunk in AUDIOT for every sound target.  The mix
+// method only changes the WAV preview, so each target gets one
+// music<nn>-<target>.tdy, and with wav a music<nn>-<target>-<mix>.wav for
+// every mix method
+//
+int ConvertAudioFiles(const char* headerFilename, const char* audioFilename, int startMusic, bool writeWav)
+{
+	MappedFile header, audio;
+	
+	if(!MapFile(headerFilename, &header))
+	{
+		printf("Could not open %s\n", headerFilename);
+		return 1;
+	}
+	if(!MapFile(audioFilename, &audio))
+	{
+		printf("Could not open %s\n", audioFilename);
+		return 1;
+	}
+	
+	const uint32_t* offsets = (const uint32_t*) header.data;
+	int numChunks = (int)(header.size / sizeof(uint32_t)) - 1;
+	
+	if(startMusic >= numChunks)
+	{
+		printf("No music chunks after chunk %d (%d chunks)\n", startMusic, numChunks);
+		return 1;
+	}
+	
+	int numSongs = numChunks - startMusic;
+	// Output 0 of each song and target is the Tandy stream, the rest are WAVs
+	int numOutputs = writeWav ? 1 + NUM_MIX_METHODS : 1;
+	int numJobs = numSongs * NUM_SOUND_TARGETS * numOutputs;
+	bool* failed = new bool[numJobs];
+	
+	printf("Converting %d songs for %d targets..\n", numSongs, NUM_SOUND_TARGETS);
+	
+	RunJobs(numJobs, [&](int job)
+	{
+		int song = job / (NUM_SOUND_TARGETS * numOutputs);
+		int target = (job / numOutputs) % NUM_SOUND_TARGETS;
+		int output = job % numOutputs;
+		
+		SoundProfile profile = soundTargets[target];
+		if(output > 0)
+		{
+			profile.mixMethod = (MixMethod)(output - 1);
+		}
+		
+		uint32_t start = offsets[startMusic + song];
+		uint32_t end = offsets[startMusic + song + 1];
+		failed[job] = false;
+		
+		if(end <= start || end > (uint32_t) audio.size)
+		{
+			// Empty or missing chunk
+			return;
+		}
+		
+		OutputBuffer out;
+		memset(&out, 0, sizeof(OutputBuffer));
+		
+		SongState* state = new SongState;
+		char filename[64];
+		
+		if(output == 0)
+		{
+			InitSongState(state, &profile, &out);
+			ConvertSong(state, audio.data + start, (int)(end - start), NULL);
+			snprintf(filename, sizeof(filename), "music%02d-%s.tdy", song, profile.name);
+			failed[job] = !SaveTandyStream(&out, filename, NULL);
 		}
 		else
 		{
-			for(int v = 0; v < NUM_VOICES; v++)
-			{
-				voices[v].currentOutputChannel = -1;
+			InitSongState(state, &profile, NULL);
+			ConvertSong(state, audio.data + start, (int)(end - start), &out);
+			snprintf(filename, sizeof(filename), "music%02d-%s-%s.wav", song, profile.name, mixMethodNames[profile.mixMethod]);
+			failed[job] = !SaveOutput(&out, filename);
+		}
+		
+		delete state;
+		FreeOutput(&out);
+	});
+	
+	int result = 0;
+	for(int n = 0; n < numJobs; n++)
+	{
+		if(failed[n])
+		{
+			result = 1;
+		}
+	}
+	
+	delete[] failed;
+	UnmapFile(&header);
+	UnmapFile(&audio);
+	
+	return result;
+}
 
-				voices[v].noise = voices[v].mfm[0] >= 6 || voices[v].mfm[1] >= 6;
-				if(voices[v].noise)
-				{
-					voices[v].currentOutputChannel = NOISE_CHANNEL;
-				}
-			}
+//
+// Bench mode.  Converts every music chunk the way batch with wav does but
+// keeps the results in memory, timing the Tandy conversion, the stream
+// optimiser and the WAV render loop as separate stages.  The Tandy streams
+// are made once per target and the WAVs once per target and mix method.
+// The optimised streams and WAVs are checked against IMFGOLD.TXT, which
+// "golden" rewrites.  wolfdemo/IMFGOLD.TXT covers the shareware
+// AUDIOHED.WL1/AUDIOT.WL1
+//
+#define BENCH_GOLDEN_FILE "IMFGOLD.TXT"
 
-			int start = 0;
-			
-			if(mixMethod == Mix_RoundRobin)
-			{
-				start = ((int)(time * 70)) % NUM_VOICES;
-			}
-				
-			for(int c = 0; c < MAX_CHANNELS; c++)
+int BenchmarkAudioFiles(const char* headerFilename, const char* audioFilename, int startMusic, bool updateGolden)
+{
+	MappedFile header, audio;
+	
+	if(!MapFile(headerFilename, &header))
+	{
+		printf("Could not open %s\n", headerFilename);
+		return 1;
+	}
+	if(!MapFile(audioFilename, &audio))
+	{
+		printf("Could not open %s\n", audioFilename);
+		return 1;
+	}
+	
+	const uint32_t* offsets = (const uint32_t*) header.data;
+	int numChunks = (int)(header.size / sizeof(uint32_t)) - 1;
+	
+	if(startMusic >= numChunks)
+	{
+		printf("No music chunks after chunk %d (%d chunks)\n", startMusic, numChunks);
+		return 1;
+	}
+	
+	int numSongs = numChunks - startMusic;
+	int numProfiles = NUM_SOUND_TARGETS * NUM_MIX_METHODS;
+	int numTandyJobs = numSongs * NUM_SOUND_TARGETS;
+	int numWavJobs = numSongs * numProfiles;
+	
+	OutputBuffer* raw = new OutputBuffer[numTandyJobs];
+	OutputBuffer* optimised = new OutputBuffer[numTandyJobs];
+	uint64_t* wavHashes = new uint64_t[numWavJobs];
+	int* wavSizes = new int[numWavJobs];
+	memset(raw, 0, numTandyJobs * sizeof(OutputBuffer));
+	memset(optimised, 0, numTandyJobs * sizeof(OutputBuffer));
+	memset(wavSizes, 0, numWavJobs * sizeof(int));
+	
+	// Empty or missing chunks have no jobs
+	auto getSong = [&](int song, uint32_t* start, uint32_t* end)
+	{
+		*start = offsets[startMusic + song];
+		*end = offsets[startMusic + song + 1];
+		return *end > *start && *end <= (uint32_t) audio.size;
+	};
+	auto getWavJob = [&](int job, SoundProfile* profile, uint32_t* start, uint32_t* end)
+	{
+		*profile = soundTargets[(job % numProfiles) / NUM_MIX_METHODS];
+		profile->mixMethod = (MixMethod)(job % NUM_MIX_METHODS);
+		return getSong(job / numProfiles, start, end);
+	};
+	
+	double inputBytes = 0;
+	for(int job = 0; job < numTandyJobs; job++)
+	{
+		uint32_t start, end;
+		if(getSong(job / NUM_SOUND_TARGETS, &start, &end))
+		{
+			inputBytes += end - start;
+		}
+	}
+	
+	printf("Benchmarking %d songs for %d profiles..\n", numSongs, numProfiles);
+	
+	BenchRun("Convert to Tandy", [&]()
+	{
+		RunJobs(numTandyJobs, [&](int job)
+		{
+			uint32_t start, end;
+			if(getSong(job / NUM_SOUND_TARGETS, &start, &end))
 			{
-				int bestVoice = -1;
-				for(int i = 0; i < NUM_VOICES; i++)
-				{
-					int v = (start + i) % NUM_VOICES;
-					if(voices[v].on && voices[v].currentOutputChannel == -1)
-					{
-						if(mixMethod == Mix_RoundRobin || mixMethod == Mix_ByVoiceNumber)
-						{
-							bestVoice = v;
-							break;
-						}
-						else
-						{
-							switch(mixMethod)
-							{
-								case Mix_ReplaceLatest:
-								case Mix_PlayLatest:
-								if(bestVoice == -1 || voices[v].onTime > voices[bestVoice].onTime)
-								{
-									bestVoice = v;
-								}
-								break;
-								
-								case Mix_ReplaceLoudest:
-								case Mix_PlayLoudest:
-								if(bestVoice == -1 || voices[v].volume > voices[bestVoice].volume)
-								{
-									bestVoice = v;
-								}
-								else if(voices[v].volume == voices[bestVoice].volume)
-								{
-									if(voices[v].onTime > voices[bestVoice].onTime)
-									{
-										bestVoice = v;
-									}
-								}
-								break;
-							}
-						}
-					}
-				}	
-				if(bestVoice != -1)
-				{
-					voices[bestVoice].currentOutputChannel = c;
-				}
-				//channelAllocation[c] = bestVoice;
+				SongState* state = new SongState;
+				InitSongState(state, &soundTargets[job % NUM_SOUND_TARGETS], &raw[job]);
+				ConvertSong(state, audio.data + start, (int)(end - start), NULL);
+				delete state;
 			}
-			
-			if(mixMethod == Mix_ReplaceLatest || mixMethod == Mix_ReplaceLoudest)
+		});
+		return inputBytes;
+	});
+	
+	BenchRun("OptimiseTandyStream", [&]()
+	{
+		RunJobs(numTandyJobs, [&](int job)
+		{
+			if(raw[job].size)
 			{
-				for(int v = 0; v < NUM_VOICES; v++)
-				{
-					if(voices[v].currentOutputChannel == -1)
-						voices[v].on = false;
-				}				
+				OptimiseTandyStream(&raw[job], &optimised[job]);
 			}
-			
-			float channelFrequency[3];
-			int channelVolume[4];
-			
-			memset(channelFrequency, 0, 3 * sizeof(float));
-			memset(channelVolume, 0, sizeof(int) * 4);
-			
-			for(int v = 0; v < NUM_VOICES; v++)
+		});
+		
+		double rawBytes = 0;
+		for(int job = 0; job < numTandyJobs; job++)
+		{
+			rawBytes += raw[job].size;
+		}
+		return rawBytes;
+	});
+	
+	BenchRun("Render WAV", [&]()
+	{
+		RunJobs(numWavJobs, [&](int job)
+		{
+			SoundProfile profile;
+			uint32_t start, end;
+			if(getWavJob(job, &profile, &start, &end))
 			{
-				bool canPlay = voices[v].currentOutputChannel != -1;
+				// WAVs are big, so each is hashed and thrown away straight off
+				OutputBuffer wav;
+				memset(&wav, 0, sizeof(OutputBuffer));
 				
-				if(voices[v].on && canPlay)
-				{
-					if(voices[v].currentOutputChannel == NOISE_CHANNEL)
-					{
-						channelVolume[NOISE_CHANNEL] = 1;
-						if(voices[v].volume > channelVolume[NOISE_CHANNEL])
-						{
-							channelVolume[NOISE_CHANNEL] = voices[v].volume;
-						}
-					}
-					else
-					{
-						channelVolume[voices[v].currentOutputChannel] = voices[v].volume;
-						channelFrequency[voices[v].currentOutputChannel] = voices[v].frequency;
-					}
-				}
-			}			
-			
-			for(int c = 0; c < 3; c++)
-			{
-				WriteFrequency(fout, c, channelFrequency[c]);
-			}
-			for(int c = 0; c < 4; c++)
-			{
-				WriteVolume(fout, c, channelVolume[c]);
+				SongState* state = new SongState;
+				InitSongState(state, &profile, NULL);
+				ConvertSong(state, audio.data + start, (int)(end - start), &wav);
+				delete state;
+				
+				wavHashes[job] = HashBytes(HASH_START, wav.data, wav.size);
+				wavSizes[job] = wav.size;
+				FreeOutput(&wav);
 			}
-			
-			uint16_t wait = (uint16_t)(ms * 1000.0f / 1000.0f);
-			WriteNoiseType(fout, 1, 0, wait);
-		}
-		#endif
+		});
 		
-		if(bytesRead >= musicSize)
+		// Rated by the samples it produces
+		double wavBytes = 0;
+		for(int job = 0; job < numWavJobs; job++)
 		{
-			break;
+			wavBytes += wavSizes[job];
 		}
+		return wavBytes;
+	});
+	
+	for(int job = 0; job < numTandyJobs; job++)
+	{
+		uint32_t start, end;
+		if(getSong(job / NUM_SOUND_TARGETS, &start, &end))
+		{
+			char name[64];
+			snprintf(name, sizeof(name), "music%02d-%s.tdy", job / NUM_SOUND_TARGETS, soundTargets[job % NUM_SOUND_TARGETS].name);
+			BenchAddHash(name, optimised[job].data, optimised[job].size);
+		}
+		
+		FreeOutput(&raw[job]);
+		FreeOutput(&optimised[job]);
 	}
 	
-	/*for(int n = 0; n < SAMPLE_RATE; n++)
+	for(int job = 0; job < numWavJobs; job++)
 	{
-		double val = sin(300.0 * n / SAMPLE_RATE);
-		uint8_t out = (uint8_t)(val * 127);
-		fwrite(&out, 1, 1, fout);
-		sampleCount++;
-	}*/
+		SoundProfile profile;
+		uint32_t start, end;
+		if(getWavJob(job, &profile, &start, &end))
+		{
+			char name[64];
+			snprintf(name, sizeof(name), "music%02d-%s-%s.wav", job / numProfiles, profile.name, mixMethodNames[profile.mixMethod]);
+			BenchHash entry;
+			entry.name = name;
+			entry.hash = wavHashes[job];
+			benchHashes.push_back(entry);
+		}
+	}
+	
+	delete[] raw;
+	delete[] optimised;
+	delete[] wavHashes;
+	delete[] wavSizes;
+	UnmapFile(&header);
+	UnmapFile(&audio);
+	
+	BenchReport();
+	return BenchCheckGolden(BENCH_GOLDEN_FILE, updateGolden) ? 1 : 0;
+}
 
-	if(outputWav)
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
 	{
-		fseek(fout, 0, SEEK_SET);
-		PopulateWaveHeader(waveHeader, sampleCount);
-		fwrite(&waveHeader, sizeof(WaveHeader), 1, fout);
+		printf("Usage: %s [filename] [target] [mix method]\n", argv[0]);
+		printf("       %s batch [audiohed] [audiot] [start n] [wav] [threads n]\n", argv[0]);
+		printf("       %s bench [audiohed] [audiot] [start n] [golden] [threads n]\n", argv[0]);
+		printf("Targets:");
+		for(int n = 0; n < NUM_SOUND_TARGETS; n++)
+			printf(" %s", soundTargets[n].name);
+		printf("\nMix methods:");
+		for(int n = 0; n < NUM_MIX_METHODS; n++)
+			printf(" %s", mixMethodNames[n]);
+		printf("\n");
+		return 0;
 	}
 	
-	fclose(fs);	
+	GenerateWaveTables();
 	
-	fclose(fout);
+	if(!strcmp(argv[1], "batch") || !strcmp(argv[1], "bench"))
+	{
+		bool bench = !strcmp(argv[1], "bench");
 		
-	for(int v = 0; v < NUM_VOICES; v++)
+		if(argc < 4)
+		{
+			printf(bench ? "Usage: %s bench [audiohed] [audiot] [start n] [golden] [threads n]\n" : "Usage: %s batch [audiohed] [audiot] [start n] [wav] [threads n]\n", argv[0]);
+			return 0;
+		}
+		
+		int startMusic = DEFAULT_START_MUSIC;
+		bool writeWav = false;
+		bool updateGolden = false;
+		
+		for(int n = 4; n < argc; n++)
+		{
+			if(!strcmp(argv[n], "start") && n + 1 < argc)
+			{
+				startMusic = atoi(argv[++n]);
+			}
+			else if(!strcmp(argv[n], "threads") && n + 1 < argc)
+			{
+				numThreads = atoi(argv[++n]);
+			}
+			else if(!strcmp(argv[n], "wav"))
+			{
+				writeWav = true;
+			}
+			else if(!strcmp(argv[n], "golden"))
+			{
+				updateGolden = true;
+			}
+		}
+		
+		if(bench)
+		{
+			return BenchmarkAudioFiles(argv[2], argv[3], startMusic, updateGolden);
+		}
+		return ConvertAudioFiles(argv[2], argv[3], startMusic, writeWav);
+	}
+	
+	SoundProfile profile = soundTargets[Target_Tandy];
+	
+	for(int n = 2; n < argc; n++)
 	{
-		if(!voices[v].used)
-			continue;
+		const SoundProfile* target = FindSoundTarget(argv[n]);
+		int mix = FindMixMethod(argv[n]);
 		
-		printf("Voice %d:\n", v);
-		printf(" Feedback: %d Algorithm: %d\n", voices[v].feedback, voices[v].algorithm);
-		for(int op = 0; op < 2; op++)
+		if(target)
 		{
-			printf(" [%d] ", op + 1);
-			printf("Attack: %d Decay: %d Sustain: %d Release: %d\n", voices[v].attack[op], voices[v].decay[op],  voices[v].sustain[op], voices[v].release[op]);
-			printf("      ampmod: %d vib: %d egt: %d ksr: %d mfm: %d\n", voices[v].ampmod[op], voices[v].vib[op], voices[v].egt[op], voices[v].ksr[op], voices[v].mfm[op]);
-
-			printf("\n");
+			MixMethod mixMethod = profile.mixMethod;
+			profile = *target;
+			profile.mixMethod = mixMethod;
+		}
+		else if(mix != -1)
+		{
+			profile.mixMethod = (MixMethod) mix;
+		}
+		else
+		{
+			printf("Unknown option %s\n", argv[n]);
+			return 0;
 		}
 	}
 	
-	return 0;
+	//voices[1].noise = true;
+	//voices[8].noise = true;
+	//voices[5].noise = true;
+	//voices[8].noise = true;
+
+	// GETTHEM
+	//voices[1].noise = true;
+	
+	// WARMARCH
+	//voices[1].noise = true;
+	
+	return ConvertFile(argv[1], profile);
 }
@@ -0,0 +1,49 @@
+//
+// Worker thread pool shared by the converters
+//
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+// 0 means one thread per core
+int numThreads = 0;
+
+//
+// Runs job(0) .. job(numJobs - 1) on a pool of worker threads.  Every job
+// only writes its own outputs, so the results are the same whichever order
+// they finish in
+//
+template<typename Job>
+void RunJobs(int numJobs, Job job)
+{
+	int threadCount = numThreads > 0 ? numThreads : (int) std::thread::hardware_concurrency();
+	if(threadCount < 1)
+	{
+		threadCount = 1;
+	}
+	if(threadCount > numJobs)
+	{
+		threadCount = numJobs;
+	}
+	
+	std::atomic<int> nextJob(0);
+	std::vector<std::thread> workers;
+	
+	for(int t = 0; t < threadCount; t++)
+	{
+		workers.push_back(std::thread([&]()
+		{
+			int jobIndex;
+			while((jobIndex = nextJob++) < numJobs)
+			{
+				job(jobIndex);
+			}
+		}));
+	}
+	
+	for(int t = 0; t < threadCount; t++)
+	{
+		workers[t].join();
+	}
+}
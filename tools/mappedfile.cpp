@@ -0,0 +1,124 @@
+//
+// Read-only file mapping for the converters.  The source data files are only
+// ever read, so they are mapped straight into memory rather than copied into
+// heap buffers.  If the file can't be mapped it is read into memory instead.
+//
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct MappedFile
+{
+	uint8_t* data;
+	long size;
+	bool isMapped;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+bool ReadWholeFile(const char* filename, MappedFile* mappedFile)
+{
+	FILE* fs = fopen(filename, "rb");
+
+	if(!fs)
+	{
+		return false;
+	}
+
+	fseek(fs, 0, SEEK_END);
+	mappedFile->size = ftell(fs);
+	fseek(fs, 0, SEEK_SET);
+
+	mappedFile->data = new uint8_t[mappedFile->size + 1];
+	fread(mappedFile->data, 1, mappedFile->size, fs);
+	fclose(fs);
+
+	mappedFile->isMapped = false;
+	return true;
+}
+
+//
+// Returns false if the file doesn't exist.  The data must not be written to
+//
+bool MapFile(const char* filename, MappedFile* mappedFile)
+{
+	memset(mappedFile, 0, sizeof(MappedFile));
+
+#ifdef _WIN32
+	mappedFile->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(mappedFile->file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	mappedFile->size = (long) GetFileSize(mappedFile->file, NULL);
+	if(mappedFile->size > 0)
+	{
+		mappedFile->mapping = CreateFileMappingA(mappedFile->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(mappedFile->mapping)
+		{
+			mappedFile->data = (uint8_t*) MapViewOfFile(mappedFile->mapping, FILE_MAP_READ, 0, 0, 0);
+			if(mappedFile->data)
+			{
+				mappedFile->isMapped = true;
+				return true;
+			}
+			CloseHandle(mappedFile->mapping);
+		}
+	}
+	CloseHandle(mappedFile->file);
+#else
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1)
+	{
+		return false;
+	}
+
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+	{
+		void* data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data != MAP_FAILED)
+		{
+			close(fd);
+			mappedFile->data = (uint8_t*) data;
+			mappedFile->size = (long) fileStat.st_size;
+			mappedFile->isMapped = true;
+			return true;
+		}
+	}
+	close(fd);
+#endif
+
+	return ReadWholeFile(filename, mappedFile);
+}
+
+void UnmapFile(MappedFile* mappedFile)
+{
+	if(mappedFile->isMapped)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(mappedFile->data);
+		CloseHandle(mappedFile->mapping);
+		CloseHandle(mappedFile->file);
+#else
+		munmap(mappedFile->data, mappedFile->size);
+#endif
+	}
+	else
+	{
+		delete[] mappedFile->data;
+	}
+
+	mappedFile->data = NULL;
+	mappedFile->size = 0;
+}
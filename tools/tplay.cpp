@@ -4,21 +4,218 @@
 #include <dos.h>
 #include <conio.h>
 #include <time.h>
+#include <malloc.h>
+#include <string.h>
 
 #define SOUND_FIRST_BYTE 0x80
 #define ATTENUATION_MASK 0x10
 
 #define NOISE_CHANNEL_MASK 0x60
 
+// Stream encoding, see OptimiseTandyStream() in imfconvert.cpp
+#define TANDY_SHORT_WAIT_MAX 0x80
+#define TANDY_LONG_WAIT 0xfe
+
 typedef void (__interrupt __far* INTFUNCPTR)(void);
 
 INTFUNCPTR oldTimerInterrupt; 
 volatile long int milliseconds;
+volatile long int timerTicks;		// Never reset, for the timing log
+unsigned timerRate;
+
+bool streamMode = false;
+
+//
+// Timing instrumentation.  Whenever commands are sent the PIT counter is
+// latched, giving the time in PIT clocks to well under a tick.  The time
+// since the previous send is logged against the delay the stream asked for,
+// and the running difference between the two is the drift from the song's
+// timeline.  The PIT is put in mode 2 while this is on, so the count falls
+// steadily through each tick instead of twice as in mode 3
+//
+#define TIMING_LOG_SIZE 1024			// Must be a power of two
+#define TIMING_HISTOGRAM_SIZE 32
+#define TIMING_HISTOGRAM_MIN -8			// In quarter ticks
+
+struct TimingSample
+{
+	uint16_t intendedTicks;
+	long actualClocks;
+};
+
+bool timingEnabled = false;
+TimingSample timingLog[TIMING_LOG_SIZE];
+unsigned long timingLogCount;
+bool timingStarted;
+long timingLastIssue;
+long timingDrift;
+long timingMaxDrift;
+long timingMinDrift;
+long timingMaxLatency;
+
+//
+// Interrupts must be off
+//
+long ReadTimerClocks()
+{
+	outp(0x43, 0x00);
+	unsigned count = inp(0x40);
+	count |= inp(0x40) << 8;
+	
+	long ticks = timerTicks;
+	
+	// If the counter has reloaded but the interrupt for it hasn't run yet,
+	// the tick count is one behind
+	outp(0x20, 0x0a);
+	if((inp(0x20) & 1) && count > timerRate / 2)
+	{
+		ticks++;
+	}
+	
+	return ticks * (long) timerRate + (long)(timerRate - count);
+}
+
+void LogTiming(uint16_t intendedTicks)
+{
+	long now = ReadTimerClocks();
+	long latency = now % (long) timerRate;
+	
+	if(latency > timingMaxLatency)
+	{
+		timingMaxLatency = latency;
+	}
+	
+	if(timingStarted)
+	{
+		long actual = now - timingLastIssue;
+		TimingSample* sample = &timingLog[(unsigned)(timingLogCount & (TIMING_LOG_SIZE - 1))];
+		sample->intendedTicks = intendedTicks;
+		sample->actualClocks = actual;
+		timingLogCount++;
+		
+		timingDrift += actual - (long) intendedTicks * timerRate;
+		if(timingDrift > timingMaxDrift)
+			timingMaxDrift = timingDrift;
+		if(timingDrift < timingMinDrift)
+			timingMinDrift = timingDrift;
+	}
+	
+	timingStarted = true;
+	timingLastIssue = now;
+}
+
+void PrintTimingSummary()
+{
+	unsigned long histogram[TIMING_HISTOGRAM_SIZE];
+	unsigned numSamples = timingLogCount < TIMING_LOG_SIZE ? (unsigned) timingLogCount : TIMING_LOG_SIZE;
+	unsigned long maxCount = 1;
+	
+	memset(histogram, 0, sizeof(histogram));
+	
+	for(unsigned n = 0; n < numSamples; n++)
+	{
+		long error = timingLog[n].actualClocks - (long) timingLog[n].intendedTicks * timerRate;
+		long scaled = error * 4;
+		
+		// Round down, so that each bucket is a quarter tick wide either side of zero
+		if(scaled < 0)
+			scaled -= timerRate - 1;
+		long bucket = scaled / (long) timerRate - TIMING_HISTOGRAM_MIN;
+		
+		if(bucket < 0)
+			bucket = 0;
+		if(bucket >= TIMING_HISTOGRAM_SIZE)
+			bucket = TIMING_HISTOGRAM_SIZE - 1;
+		
+		histogram[bucket]++;
+		if(histogram[bucket] > maxCount)
+			maxCount = histogram[bucket];
+	}
+	
+	printf("Timing: %lu sends logged, last %u kept\n", timingLogCount, numSamples);
+	printf("Error per send, in ticks (actual - intended):\n");
+	
+	for(int n = 0; n < TIMING_HISTOGRAM_SIZE; n++)
+	{
+		if(!histogram[n])
+			continue;
+		
+		float error = (n + TIMING_HISTOGRAM_MIN) / 4.0f;
+		printf("%s%6.2f %6lu ", n == 0 ? "<=" : (n == TIMING_HISTOGRAM_SIZE - 1 ? ">=" : "  "), error, histogram[n]);
+		for(unsigned long c = 0; c < (histogram[n] * 50) / maxCount; c++)
+			putchar('#');
+		putchar('\n');
+	}
+	
+	printf("Drift: final %.2f ticks, range %.2f to %.2f ticks\n",
+		(float) timingDrift / timerRate, (float) timingMinDrift / timerRate, (float) timingMaxDrift / timerRate);
+	printf("Latest send after a tick: %.2f ticks\n", (float) timingMaxLatency / timerRate);
+}
+
+//
+// Preloaded playback.  The whole stream is compiled up front into records,
+// each a run of bytes to send to the sound chip followed by a delay in
+// ticks, and the timer interrupt plays them back without touching DOS
+//
+struct PlayRecord
+{
+	uint16_t numWrites;
+	uint16_t ticks;
+};
+
+PlayRecord __far* playRecords;
+uint8_t __far* playData;
+unsigned numPlayRecords;
+
+volatile unsigned playRecordIndex;
+volatile unsigned playDataIndex;
+volatile uint16_t playTicksLeft;
+volatile bool playing;
+
+void PlaybackTick()
+{
+	static uint16_t intendedTicks = 0;
+	
+	if(playTicksLeft > 1)
+	{
+		playTicksLeft--;
+		return;
+	}
+	
+	if(timingEnabled)
+	{
+		LogTiming(intendedTicks);
+	}
+	intendedTicks = 0;
+	
+	do
+	{
+		if(playRecordIndex >= numPlayRecords)
+		{
+			playing = false;
+			return;
+		}
+		
+		PlayRecord __far* record = &playRecords[playRecordIndex++];
+		for(uint16_t n = 0; n < record->numWrites; n++)
+		{
+			outp(0xc0, playData[playDataIndex++]);
+		}
+		playTicksLeft = record->ticks;
+		intendedTicks += record->ticks;
+	} while(!playTicksLeft);
+}
 
 void __interrupt __far TimerHandler(void)
 {
 	static unsigned long count = 0; // To keep track of original timer ticks
 	++milliseconds;
+	++timerTicks;
+	
+	if(playing)
+	{
+		PlaybackTick();
+	}
 	count += 1103;
 
 	if (count >= 65536) // It is now time to call the original handler
@@ -49,12 +246,13 @@ void InstallTimer()
 	r.x.dx = FP_OFF(TimerHandler);
 	int86x(0x21, &r, &r, &s);
 	/* Set resolution of timer chip to 1ms: */
-	outp(0x43, 0x36);
+	outp(0x43, timingEnabled ? 0x34 : 0x36);
 //	outp(0x40, (unsigned char)(1103 & 0xff));
 //	outp(0x40, (unsigned char)((1103 >> 8) & 0xff));
 
 	int hz = 1000;
 	int rate = 1192030 / hz;
+	timerRate = rate;
 
 	outp(0x40, (unsigned char)(rate & 0xff));
 	outp(0x40, (unsigned char)((rate >> 8) & 0xff));
@@ -112,6 +310,183 @@ void SetChannelVolume(int channel, int volume)
 	outp(0xc0, SOUND_FIRST_BYTE | channelBits | ATTENUATION_MASK | (attenuation & 0xf));
 }
 
+bool IsFrequencyLatch(uint8_t data)
+{
+	return (data & 0x90) == 0x80 && (data & 0x60) != 0x60;
+}
+
+//
+// Loads a stream into a far buffer and compiles it in place: the bytes for
+// the sound chip are packed down to the start of the buffer, and the waits
+// between them become the record list
+//
+bool PreloadSong(const char* filename)
+{
+	FILE* fs = fopen(filename, "rb");
+	if(!fs)
+	{
+		printf("Could not open %s\n", filename);
+		return false;
+	}
+	
+	fseek(fs, 0, SEEK_END);
+	long size = ftell(fs);
+	fseek(fs, 0, SEEK_SET);
+	
+	if(size <= 0 || size > 0xfff0)
+	{
+		printf("%s is too large to preload, use stream mode\n", filename);
+		fclose(fs);
+		return false;
+	}
+	
+	playData = (uint8_t __far*) _fmalloc((size_t) size);
+	if(!playData)
+	{
+		printf("Not enough memory for %s\n", filename);
+		fclose(fs);
+		return false;
+	}
+	
+	// Read through a near buffer, since fread can't write to a far pointer
+	uint8_t buffer[512];
+	unsigned loaded = 0;
+	while(loaded < (unsigned) size)
+	{
+		unsigned count = (unsigned) size - loaded;
+		if(count > sizeof(buffer))
+			count = sizeof(buffer);
+		if(fread(buffer, 1, count, fs) != count)
+		{
+			printf("Could not read %s\n", filename);
+			fclose(fs);
+			return false;
+		}
+		_fmemcpy(playData + loaded, buffer, count);
+		loaded += count;
+	}
+	fclose(fs);
+	
+	// Every record ends in a wait of at least one byte, plus one for a
+	// trailing run of writes with no wait after it
+	unsigned maxRecords = 1;
+	for(unsigned n = 0; n < loaded; n++)
+	{
+		if(playData[n] < TANDY_SHORT_WAIT_MAX || playData[n] == TANDY_LONG_WAIT)
+			maxRecords++;
+	}
+	
+	if(maxRecords > 0xfff0 / sizeof(PlayRecord))
+	{
+		printf("%s is too large to preload, use stream mode\n", filename);
+		return false;
+	}
+	
+	playRecords = (PlayRecord __far*) _fmalloc(maxRecords * sizeof(PlayRecord));
+	if(!playRecords)
+	{
+		printf("Not enough memory for %s\n", filename);
+		return false;
+	}
+	
+	unsigned readPos = 0;
+	unsigned writePos = 0;
+	PlayRecord record = { 0, 0 };
+	numPlayRecords = 0;
+	
+	while(readPos < loaded)
+	{
+		uint8_t data = playData[readPos++];
+		uint16_t wait = 0;
+		
+		if(data < TANDY_SHORT_WAIT_MAX)
+		{
+			wait = data + 1;
+		}
+		else if(data == TANDY_LONG_WAIT)
+		{
+			if(readPos + 2 > loaded)
+				break;
+			wait = playData[readPos] | (playData[readPos + 1] << 8);
+			readPos += 2;
+			
+			if(!wait)
+			{
+				// Escaped register write
+				playData[writePos++] = TANDY_LONG_WAIT;
+				record.numWrites++;
+			}
+		}
+		else
+		{
+			playData[writePos++] = data;
+			record.numWrites++;
+			
+			if(IsFrequencyLatch(data) && readPos < loaded)
+			{
+				playData[writePos++] = playData[readPos++];
+				record.numWrites++;
+			}
+		}
+		
+		if(wait)
+		{
+			record.ticks = wait;
+			playRecords[numPlayRecords++] = record;
+			record.numWrites = 0;
+			record.ticks = 0;
+		}
+	}
+	
+	if(record.numWrites)
+	{
+		playRecords[numPlayRecords++] = record;
+	}
+	
+	printf("Loaded %s: %ld bytes, %u records\n", filename, size, numPlayRecords);
+	return true;
+}
+
+void FreeSong()
+{
+	if(playRecords)
+		_ffree(playRecords);
+	if(playData)
+		_ffree(playData);
+	playRecords = NULL;
+	playData = NULL;
+	numPlayRecords = 0;
+}
+
+int PlayPreloaded(const char* filename)
+{
+	if(!PreloadSong(filename))
+	{
+		FreeSong();
+		return 0;
+	}
+	
+	_disable();
+	playRecordIndex = 0;
+	playDataIndex = 0;
+	playTicksLeft = 0;
+	playing = true;
+	_enable();
+	
+	while(playing)
+	{
+		if(kbhit())
+		{
+			getch();
+			break;
+		}
+	}
+	
+	playing = false;
+	FreeSong();
+	return 0;
+}
+
 void Wait(int delay)
 {
 	milliseconds = 0;
@@ -120,9 +495,9 @@ void Wait(int delay)
 
 int domain(int argc, char* argv[])
 {
-	if(argc != 2)
+	if(argc < 2)
 	{
-		printf("Usage: %s [file]\n", argv[0]);
+		printf("Usage: %s [file] [stream] [timing]\n", argv[0]);
 		
 
 		int testFrequency = 440;
@@ -192,12 +567,23 @@ int domain(int argc, char* argv[])
 		PlayChannel(c, 1, 0);
 	}
 	*/
+	
+	if(!streamMode)
+	{
+		return PlayPreloaded(argv[1]);
+	}
+	
+	// Streams straight from disk, for songs too big to preload
 	FILE* fs = fopen(argv[1], "rb");
 	if(!fs)
 	{
 		printf("Could not open %s\n", argv[1]);
+		return 0;
 	}
 	
+	uint16_t intendedTicks = 0;
+	bool sendPending = true;
+	
 	while(!feof(fs))
 	{
 		//if(kbhit())
@@ -205,28 +591,62 @@ int domain(int argc, char* argv[])
 		//	break;
 		//}
 		uint8_t data;
-		fread(&data, 1, 1, fs);
+		if(!fread(&data, 1, 1, fs))
+		{
+			break;
+		}
+		
+		uint16_t wait = 0;
 		
-		if(data == 0xfe)
+		if(data < TANDY_SHORT_WAIT_MAX)
+		{
+			wait = data + 1;
+		}
+		else if(data == TANDY_LONG_WAIT)
 		{
-			// This is a wait command
-			uint16_t wait;
 			fread(&wait, 2, 1, fs);
-
-			milliseconds = 0;
-			while(milliseconds < wait)
-			{
-				if(kbhit())
-				{
-					fclose(fs);
-					return 0;
-				}
-			}		
 		}
-		else
+		
+		if(!wait)
 		{
+			if(timingEnabled && sendPending)
+			{
+				_disable();
+				LogTiming(intendedTicks);
+				_enable();
+				intendedTicks = 0;
+			}
+			sendPending = false;
+			
+			if(data == TANDY_LONG_WAIT)
+			{
+				// Escaped register write
+				outp(0xc0, TANDY_LONG_WAIT);
+				continue;
+			}
+			
 			outp(0xc0, data);
+			
+			if(IsFrequencyLatch(data))
+			{
+				fread(&data, 1, 1, fs);
+				outp(0xc0, data);
+			}
+			continue;
 		}
+		
+		intendedTicks += wait;
+		sendPending = true;
+
+		milliseconds = 0;
+		while(milliseconds < wait)
+		{
+			if(kbhit())
+			{
+				fclose(fs);
+				return 0;
+			}
+		}		
 	}
 	
 	fclose(fs);
@@ -236,6 +656,18 @@ int domain(int argc, char* argv[])
 
 int main(int argc, char* argv[])
 {
+	for(int n = 2; n < argc; n++)
+	{
+		if(!stricmp(argv[n], "stream"))
+		{
+			streamMode = true;
+		}
+		else if(!stricmp(argv[n], "timing"))
+		{
+			timingEnabled = true;
+		}
+	}
+	
 	InstallTimer();
 	domain(argc, argv);
 	
@@ -244,4 +676,9 @@ int main(int argc, char* argv[])
 		SetChannelVolume(n, 0);
 	}
 	ShutdownTimer();
+	
+	if(timingEnabled)
+	{
+		PrintTimingSummary();
+	}
 }
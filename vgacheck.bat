@@ -0,0 +1 @@
+c:\dosbox-x\dosbox-x.exe -conf dosbox-vgacheck.conf
\ No newline at end of file